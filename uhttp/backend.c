@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+//stand-in application backend for trying the server's reverse proxy, -P, without a real application
+//it speaks persistent http 1.1 and answers by the last part of the path:
+//  .../headers    the request head it received, as the body
+//  .../chunked    a chunked body with a trailer
+//  .../early      a 103 Early Hints response before the final one
+//  .../close      a body without a length, ended by closing the connection
+//  anything else  "ok\n", or for a request with a body the body echoed back, after a 100 Continue if asked for
+
+#define BUFSIZE 8192
+
+void error(char *msg) {
+	printf("Error %s\n", msg);
+	exit(-1);
+}
+
+int send_all(int fd, char *data, int len) {
+	int n;
+	
+	while(len > 0) {
+		n = send(fd, data, len, MSG_NOSIGNAL);
+		if(n <= 0) return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//find header value in the head, returns a pointer to the value or NULL
+char *find_header(char *head, char *name) {
+	int name_len = strlen(name);
+	char *line = strstr(head, "\r\n");
+	
+	while(line != NULL && line[2] != '\r') {
+		line += 2;
+		if(strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+			line += name_len + 1;
+			while(*line == ' ') line++;
+			return line;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+//answer one request whose head, ending in an empty line, is the first head_len bytes of buf
+//any body bytes that came with the head follow it, *len is the number of bytes in buf and is left holding what follows the request
+//returns 1 if the connection stays open for another request, 0 if it should close, or -1 on error
+int respond(int fd, char *buf, int head_len, int *len) {
+	char head[BUFSIZE + 256], *path, *path_end, *name, *value, *body;
+	long body_len = 0;
+	int n, got, persist;
+	
+	buf[head_len - 2] = 0;
+	path = strchr(buf, ' ');
+	if(path == NULL) return -1;
+	path++;
+	path_end = strchr(path, ' ');
+	if(path_end == NULL) return -1;
+	*path_end = 0;
+	name = strrchr(path, '/');
+	name = name == NULL ? path : name + 1;
+	*path_end = ' ';
+	
+	value = find_header(buf, "Connection");
+	persist = value == NULL || strncasecmp(value, "close", 5) != 0;
+	value = find_header(buf, "Content-Length");
+	if(value != NULL) body_len = atol(value);
+	if(body_len < 0 || body_len > BUFSIZE) return -1;
+	
+	//read the rest of the body, telling the client to go ahead first if it is waiting to be told
+	value = find_header(buf, "Expect");
+	if(body_len > *len - head_len && value != NULL && strncasecmp(value, "100-continue", 12) == 0)
+		if(send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0) return -1;
+	body = malloc(body_len + 1);
+	n = *len - head_len < body_len ? *len - head_len : body_len;
+	memcpy(body, buf + head_len, n);
+	while(n < body_len) {
+		got = recv(fd, body + n, body_len - n, 0);
+		if(got <= 0) {
+			free(body);
+			return -1;
+		}
+		n += got;
+	}
+	
+	if(strncmp(name, "headers", 7) == 0) {
+		n = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s\r\n", head_len, buf);
+		if(send_all(fd, head, n) < 0) persist = -1;
+	}
+	else if(strncmp(name, "chunked", 7) == 0) {
+		strcpy(head, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n6\r\nhello \r\n6\r\nworld\n\r\n0\r\nX-Trailer: 1\r\n\r\n");
+		if(send_all(fd, head, strlen(head)) < 0) persist = -1;
+	}
+	else if(strncmp(name, "early", 5) == 0) {
+		strcpy(head, "HTTP/1.1 103 Early Hints\r\nLink: </style.css>; rel=preload\r\n\r\n");
+		strcat(head, "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nok\n");
+		if(send_all(fd, head, strlen(head)) < 0) persist = -1;
+	}
+	else if(strncmp(name, "close", 5) == 0) {
+		strcpy(head, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nclosed\n");
+		send_all(fd, head, strlen(head));
+		persist = 0;
+	}
+	else {
+		n = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", body_len > 0 ? body_len : 3);
+		if(send_all(fd, head, n) < 0 || send_all(fd, body_len > 0 ? body : "ok\n", body_len > 0 ? body_len : 3) < 0) persist = -1;
+	}
+	free(body);
+	
+	//keep any pipelined bytes that followed the body
+	n = *len - head_len - body_len;
+	if(n > 0) memmove(buf, buf + head_len + body_len, n);
+	*len = n > 0 ? n : 0;
+	return persist;
+}
+
+void *connection(void *arg) {
+	int fd = (int)(long)arg;
+	char buf[BUFSIZE + 1], *head_end;
+	int len = 0, n, persist = 1;
+	
+	while(persist == 1) {
+		buf[len] = 0;
+		while((head_end = strstr(buf, "\r\n\r\n")) == NULL) {
+			if(len == BUFSIZE) goto done;
+			n = recv(fd, buf + len, BUFSIZE - len, 0);
+			if(n <= 0) goto done;
+			len += n;
+			buf[len] = 0;
+		}
+		persist = respond(fd, buf, head_end + 4 - buf, &len);
+	}
+	
+done:
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	struct sockaddr_in addr;
+	int sockfd, fd, optval = 1;
+	pthread_t thread;
+	
+	if(argc != 2) {
+		printf("usage: %s <port>\n", argv[0]);
+		exit(-1);
+	}
+	
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(sockfd < 0) error("opening socket");
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(atoi(argv[1]));
+	if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error("binding socket");
+	if(listen(sockfd, 128) < 0) error("listening on socket");
+	
+	while(1) {
+		fd = accept(sockfd, NULL, NULL);
+		if(fd < 0) continue;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+		if(pthread_create(&thread, NULL, connection, (void *)(long)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+//load generator for measuring the server's latency distribution
+//each connection thread sends GET requests back to back for the duration of the run and records every latency
+
+#define BUFSIZE 65536
+#define MAX_SAMPLES 4000000
+
+struct sockaddr_in server;
+char request[1024];
+int request_len;
+int keep_alive = 0, per_thread;
+uint64_t deadline;
+
+//latencies of every completed request, in nanoseconds
+uint64_t *samples;
+int n_samples = 0, n_errors = 0;
+pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void error(char *msg) {
+	printf("Error %s\n", msg);
+	exit(-1);
+}
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int connect_server(void) {
+	int fd, optval = 1;
+	
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) error("opening socket");
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	
+	if(connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//read one response, returns 0 once its body is complete, or 1 if the server is also closing the connection
+//without keep-alive the body runs until the server closes the connection
+int read_response(int fd, char *buf) {
+	int len = 0, n, head_len, closing = 0;
+	long body_len = -1;
+	char *head_end, *value;
+	
+	while(1) {
+		n = recv(fd, buf + len, BUFSIZE - 1 - len, 0);
+		if(n < 0) return -1;
+		if(n == 0) return (keep_alive || len == 0) ? -1 : 0;
+		len += n;
+		buf[len] = 0;
+		
+		//ignore empty lines left over from the previous response
+		if(body_len < 0) {
+			n = strspn(buf, "\r\n");
+			memmove(buf, buf + n, len - n + 1);
+			len -= n;
+		}
+		
+		head_end = strstr(buf, "\r\n\r\n");
+		if(head_end == NULL) {
+			if(len == BUFSIZE - 1) return -1;
+			continue;
+		}
+		head_len = head_end + 4 - buf;
+		
+		if(body_len < 0) {
+			value = strcasestr(buf, "\r\nContent-Length:");
+			if(value == NULL || value > head_end) body_len = 0;
+			else body_len = atol(value + 17);
+			
+			value = strcasestr(buf, "\r\nConnection: close\r\n");
+			closing = value != NULL && value < head_end;
+		}
+		
+		//past the head, only the byte count matters, so reuse the buffer for the rest of the body
+		if(keep_alive && len - head_len >= body_len)
+			return (int)strspn(buf + head_len + body_len, "\r\n") == len - head_len - body_len ? closing : -1;
+		if(len == BUFSIZE - 1) {
+			body_len -= len - head_len;
+			len = head_len;
+		}
+	}
+}
+
+void *client(void *unused) {
+	uint64_t *mine = malloc(sizeof(uint64_t) * per_thread);
+	int n_mine = 0, errors = 0, fd = -1, sent, ret = -1;
+	char *buf = malloc(BUFSIZE);
+	uint64_t start;
+	
+	while(monotonic_ns() < deadline && n_mine < per_thread) {
+		start = monotonic_ns();
+		
+		if(fd < 0) fd = connect_server();
+		sent = fd >= 0 && send(fd, request, request_len, MSG_NOSIGNAL) == request_len;
+		
+		if(!sent || (ret = read_response(fd, buf)) < 0) {
+			errors++;
+			if(fd >= 0) close(fd);
+			fd = -1;
+			continue;
+		}
+		mine[n_mine++] = monotonic_ns() - start;
+		
+		//reconnect once the server has served as many requests as it allows on a connection
+		if(!keep_alive || ret == 1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if(fd >= 0) close(fd);
+	
+	pthread_mutex_lock(&samples_lock);
+	memcpy(samples + n_samples, mine, sizeof(uint64_t) * n_mine);
+	n_samples += n_mine;
+	n_errors += errors;
+	pthread_mutex_unlock(&samples_lock);
+	
+	free(mine);
+	free(buf);
+	return NULL;
+}
+
+int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	int opt, i, connections = 16, seconds = 10;
+	double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	pthread_t *threads;
+	
+	while((opt = getopt(argc, argv, "c:d:k")) != -1) {
+		if(opt == 'c') connections = atoi(optarg);
+		else if(opt == 'd') seconds = atoi(optarg);
+		else if(opt == 'k') keep_alive = 1;
+		else optind = argc + 1;
+	}
+	
+	if(optind != argc - 3 || connections <= 0 || seconds <= 0) {
+		printf("Usage %s <host> <port #> <uri> [-c <connections>] [-d <seconds>] [-k]\n", argv[0]);
+		exit(-1);
+	}
+	
+	server.sin_family = AF_INET;
+	server.sin_port = htons(atoi(argv[optind + 1]));
+	if(inet_pton(AF_INET, argv[optind], &server.sin_addr) != 1) error("parsing host address");
+	
+	request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+			argv[optind + 2], argv[optind], keep_alive ? "Keep-alive" : "close");
+	
+	per_thread = MAX_SAMPLES / connections;
+	samples = malloc(sizeof(uint64_t) * per_thread * connections);
+	threads = malloc(sizeof(pthread_t) * connections);
+	deadline = monotonic_ns() + (uint64_t)seconds * 1000000000;
+	
+	for(i = 0; i < connections; i++) pthread_create(&threads[i], NULL, client, NULL);
+	for(i = 0; i < connections; i++) pthread_join(threads[i], NULL);
+	
+	if(n_samples == 0) error("no requests completed");
+	qsort(samples, n_samples, sizeof(uint64_t), compare_samples);
+	
+	printf("%d requests, %d errors, %.0f requests/s\n", n_samples, n_errors, (double)n_samples / seconds);
+	for(i = 0; i < 4; i++)
+		printf("p%-5g %10.1f us\n", percentiles[i] * 100, samples[(int)(percentiles[i] * (n_samples - 1))] / 1000.0);
+	printf("max    %10.1f us\n", samples[n_samples - 1] / 1000.0);
+	
+	return 0;
+}
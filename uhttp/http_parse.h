@@ -0,0 +1,220 @@
+//request parsing for webserver.c, kept in its own header so parsebench.c can time the same code
+//header boundaries are found 16 or 32 bytes at a time with sse4.2 or avx2 when the cpu has them, chosen at
+//startup by http_parse_init, and methods and versions are matched with single integer loads instead of strcmp
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SCAN
+#endif
+
+//a request, including all of its headers, must fit in one buffer
+#define BUFSIZE 1024
+
+//returns a pointer to the first ':', '\r', '\n' or '\0' in [p, end), or end if there is none
+typedef char *(*scan_fn)(char *, char *);
+
+static char *scan_scalar(char *p, char *end) {
+	while(p < end && *p != ':' && *p != '\r' && *p != '\n' && *p != 0) p++;
+	return p;
+}
+
+#ifdef HAVE_X86_SCAN
+__attribute__((target("sse4.2")))
+static char *scan_sse42(char *p, char *end) {
+	//explicit length string compare, so the set can include the terminating nul
+	const __m128i set = _mm_setr_epi8(':', '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	int i;
+	
+	while(p + 16 <= end) {
+		i = _mm_cmpestri(set, 4, _mm_loadu_si128((__m128i *)p), 16,
+				_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+		if(i < 16) return p + i;
+		p += 16;
+	}
+	return scan_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static char *scan_avx2(char *p, char *end) {
+	const __m256i colon = _mm256_set1_epi8(':'), cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n'), nul = _mm256_setzero_si256();
+	__m256i chunk, hits;
+	unsigned int mask;
+	
+	while(p + 32 <= end) {
+		chunk = _mm256_loadu_si256((__m256i *)p);
+		hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, colon), _mm256_cmpeq_epi8(chunk, cr)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(chunk, lf), _mm256_cmpeq_epi8(chunk, nul)));
+		mask = _mm256_movemask_epi8(hits);
+		if(mask != 0) return p + __builtin_ctz(mask);
+		p += 32;
+	}
+	return scan_scalar(p, end);
+}
+#endif
+
+static scan_fn scan_delims = scan_scalar;
+
+//pick the widest scanner this cpu supports
+static void http_parse_init(void) {
+#ifdef HAVE_X86_SCAN
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) scan_delims = scan_avx2;
+	else if(__builtin_cpu_supports("sse4.2")) scan_delims = scan_sse42;
+#endif
+}
+
+static inline uint32_t load32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t load64(const char *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+//find the end of the line starting at p, the first ':' in it is stored in *colon (NULL if there is none)
+static char *scan_line(char *p, char *end, char **colon) {
+	*colon = NULL;
+	
+	while(1) {
+		p = scan_delims(p, end);
+		if(p == end || *p != ':') return p;
+		if(*colon == NULL) *colon = p;
+		p++;
+	}
+}
+
+//step past the line ending at p, which may be "\r\n", a bare '\n', or the end of the request
+static inline char *next_line(char *p) {
+	if(*p == '\r') p++;
+	if(*p == '\n') p++;
+	return p;
+}
+
+//note the close and keep-alive options in a Connection header value ending at end
+//options are a comma separated list of case-insensitive tokens
+static void parse_connection(char *token, char *end, int *conn_close, int *conn_keep_alive) {
+	char *token_end;
+	int token_len;
+	
+	while(token < end) {
+		while(token < end && (*token == ' ' || *token == '\t' || *token == ',')) token++;
+		token_end = memchr(token, ',', end - token);
+		if(token_end == NULL) token_end = end;
+		
+		token_len = token_end - token;
+		while(token_len > 0 && (token[token_len - 1] == ' ' || token[token_len - 1] == '\t')) token_len--;
+		
+		if(token_len == 5 && strncasecmp(token, "close", 5)==0) *conn_close = 1;
+		else if(token_len == 10 && strncasecmp(token, "keep-alive", 10)==0) *conn_keep_alive = 1;
+		
+		token = token_end;
+	}
+}
+
+//http 1.1 connections persist unless the client asks to close, http 1.0 ones only if it asks to keep them
+static inline int connection_persists(char *version, int conn_close, int conn_keep_alive) {
+	if(version[7] == '1') return !conn_close;
+	return conn_keep_alive && !conn_close;
+}
+
+//whether an Accept-Encoding value ending at end allows a gzip response
+//codings are case-insensitive, one weighted q=0 is refused, and "*" covers gzip unless gzip is listed itself
+static int accepts_gzip(char *p, char *end) {
+	char *item_end, *semi, *q;
+	int len, allowed, gzip = -1, star = 0;
+	
+	while(p < end) {
+		while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+		item_end = memchr(p, ',', end - p);
+		if(item_end == NULL) item_end = end;
+		semi = memchr(p, ';', item_end - p);
+		
+		len = (semi == NULL ? item_end : semi) - p;
+		while(len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) len--;
+		
+		allowed = 1;
+		if(semi != NULL) {
+			q = semi + 1;
+			while(q < item_end && (*q == ' ' || *q == '\t')) q++;
+			if(item_end - q > 2 && (*q == 'q' || *q == 'Q') && q[1] == '=') allowed = strtod(q + 2, NULL) > 0;
+		}
+		
+		if((len == 4 && strncasecmp(p, "gzip", 4)==0) || (len == 6 && strncasecmp(p, "x-gzip", 6)==0)) gzip = allowed;
+		else if(len == 1 && *p == '*') star = allowed;
+		
+		p = item_end;
+	}
+	return gzip >= 0 ? gzip : star;
+}
+
+//this function parses get requests and puts each individual chunk into a string passed into the function by reference
+//if there is an error in the request, return the appropriate error number
+//the request is the first len bytes of buffer and buffer[len] must be 0, whatever follows it is left alone
+//a request of BUFSIZE bytes or more is rejected, the tokens are nul terminated in place
+static int parse_get_request(char *buffer, int len, char **command, char **uri, char **version, char **ext, int *keep_alive, int *accept_gzip, char **if_none_match){
+	char *end = buffer + len, *p, *line_end, *next, *colon, *space, *dot;
+	int name_len, conn_close = 0, conn_keep_alive = 0;
+	
+	if(len >= BUFSIZE) return 400;
+	
+	//request line, leading empty lines are ignored
+	p = buffer + strspn(buffer, "\r\n");
+	line_end = scan_line(p, end, &colon);
+	if(line_end - p < 5) return 400;
+	next = next_line(line_end);
+	*line_end = 0;
+	
+	if(load32(p) == load32("GET ")) *command = p;
+	else if((load32(p) == load32("HEAD") || load32(p) == load32("POST")) && p[4] == ' ') return 405;
+	else return 400;
+	p[3] = 0;
+	
+	*uri = p + 4;
+	space = memrchr(*uri, ' ', line_end - *uri);
+	if(space == NULL || space == *uri) return 400;
+	*space = 0;
+	
+	*version = space + 1;
+	if(*version == line_end) return 400;
+	if(line_end - *version != 8 || (load64(*version) != load64("HTTP/1.0") && load64(*version) != load64("HTTP/1.1"))) return 505;
+	
+	dot = strrchr(*uri, '.');
+	if(dot==NULL) *ext = NULL;
+	else *ext = dot + 1;
+	
+	p = next;
+	
+	//walk the header lines up to the empty line that ends them
+	while(*p != 0 && *p != '\r' && *p != '\n') {
+		line_end = scan_line(p, end, &colon);
+		next = next_line(line_end);
+		name_len = colon == NULL ? 0 : colon - p;
+		
+		if(name_len == 10 && strncasecmp(p, "Connection", 10)==0) {
+			parse_connection(colon + 1, line_end, &conn_close, &conn_keep_alive);
+		}
+		else if(name_len == 15 && strncasecmp(p, "Accept-Encoding", 15)==0) {
+			*accept_gzip = accepts_gzip(colon + 1, line_end);
+		}
+		else if(name_len == 13 && strncasecmp(p, "If-None-Match", 13)==0) {
+			*if_none_match = colon + 1;
+			*line_end = 0;
+		}
+		
+		p = next;
+	}
+	
+	*keep_alive = connection_persists(*version, conn_close, conn_keep_alive);
+	
+	return 0;
+}
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http_parse.h"
+
+//microbenchmark for parse_get_request, reports ns per request for each scanner this cpu supports
+//the request headers are what a desktop browser sends for a page asset
+
+char *browser_request =
+	"GET /fancybox/jquery.fancybox-1.3.4.pack.js HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Connection: Keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Accept: */*\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Referer: http://localhost:8080/\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"If-None-Match: \"285766ee6f23d410\"\r\n"
+	"\r\n";
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//time iterations of copying the request into a fresh buffer, and parsing it unless copy_only is set
+//the copy is needed since parsing writes into the buffer, and is timed alone so it can be subtracted
+double run(int iterations, int copy_only) {
+	char buffer[BUFSIZE];
+	char *command, *uri, *version, *ext, *if_none_match;
+	int keep_alive, accept_gzip, i, len = strlen(browser_request);
+	uint64_t start;
+	
+	memset(buffer, 0, BUFSIZE);
+	start = monotonic_ns();
+	
+	for(i = 0; i < iterations; i++) {
+		memcpy(buffer, browser_request, len);
+		if(copy_only) {
+			__asm__ volatile("" : : "r"(buffer) : "memory");
+			continue;
+		}
+		
+		keep_alive = accept_gzip = 0;
+		if_none_match = NULL;
+		if(parse_get_request(buffer, len, &command, &uri, &version, &ext, &keep_alive, &accept_gzip, &if_none_match) != 0
+				|| !keep_alive || !accept_gzip || if_none_match == NULL) {
+			printf("Error request did not parse\n");
+			exit(-1);
+		}
+	}
+	
+	return (double)(monotonic_ns() - start) / iterations;
+}
+
+//the scanner http_parse_init picked, which the server will use
+scan_fn chosen;
+
+void bench(char *name, scan_fn scanner, int iterations, double copy_ns) {
+	scan_delims = scanner;
+	run(iterations / 10, 0);
+	printf("%-8s %8.1f ns/request%s\n", name, run(iterations, 0) - copy_ns, scanner == chosen ? "  (used by the server)" : "");
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 2000000;
+	double copy_ns;
+	
+	if(iterations <= 0) {
+		printf("Usage %s [iterations]\n", argv[0]);
+		exit(-1);
+	}
+	
+	run(iterations / 10, 1);
+	copy_ns = run(iterations, 1);
+	printf("%d byte request, %.1f ns/request to copy it (subtracted below)\n", (int)strlen(browser_request), copy_ns);
+	
+	http_parse_init();
+	chosen = scan_delims;
+	
+	bench("scalar", scan_scalar, iterations, copy_ns);
+#ifdef HAVE_X86_SCAN
+	if(__builtin_cpu_supports("sse4.2")) bench("sse4.2", scan_sse42, iterations, copy_ns);
+	if(__builtin_cpu_supports("avx2")) bench("avx2", scan_avx2, iterations, copy_ns);
+#endif
+	
+	return 0;
+}
@@ -0,0 +1,57 @@
+#!/bin/sh
+#runs the server as a reverse proxy in front of backend.c and checks what clients get back through it
+#usage: ./proxytest.sh [server port] [backend port], run from the uhttp directory, needs gcc and curl
+
+SERVER_PORT=${1:-8180}
+BACKEND_PORT=${2:-9180}
+BASE=http://127.0.0.1:$SERVER_PORT/api
+DIR=$(mktemp -d)
+failed=0
+
+gcc -pthread -o $DIR/server webserver.c -lz || exit 1
+gcc -pthread -o $DIR/backend backend.c || exit 1
+
+$DIR/backend $BACKEND_PORT &
+backend_pid=$!
+$DIR/server $SERVER_PORT -P /api=127.0.0.1:$BACKEND_PORT > $DIR/server.log &
+server_pid=$!
+trap 'kill $server_pid $backend_pid 2>/dev/null; rm -rf $DIR' EXIT
+sleep 1
+
+#check <name> <expected> <actual>, the expected text has to appear somewhere in the actual output
+check() {
+	case "$3" in
+	*"$2"*) echo "ok      $1" ;;
+	*) echo "FAILED  $1: expected \"$2\", got:"; echo "$3"; failed=1 ;;
+	esac
+}
+
+#check_not <name> <unexpected> <actual>
+check_not() {
+	case "$3" in
+	*"$2"*) echo "FAILED  $1: \"$2\" should not be in:"; echo "$3"; failed=1 ;;
+	*) echo "ok      $1" ;;
+	esac
+}
+
+check "plain GET" "ok" "$(curl -s $BASE/x)"
+check "keep-alive reuses the client connection" "Re-using existing connection" "$(curl -sv $BASE/x $BASE/y 2>&1)"
+check_not "Connection isn't forwarded" "Connection" "$(curl -s -H 'Connection: close' $BASE/headers)"
+check_not "Keep-Alive isn't forwarded" "Keep-Alive" "$(curl -s -H 'Keep-Alive: timeout=1' $BASE/headers)"
+check "client gets its own Connection header" "Connection: close" "$(curl -s -D - -H 'Connection: close' $BASE/x)"
+check "HTTP/1.0 request gets a Host" "Host: 127.0.0.1:$BACKEND_PORT" "$(curl -s --http1.0 -H 'Host:' $BASE/headers)"
+check "chunked response" "Transfer-Encoding: chunked" "$(curl -s -D - $BASE/chunked)"
+check "chunked body" "hello world" "$(curl -s $BASE/chunked)"
+check_not "HTTP/1.0 gets no chunking" "chunked" "$(curl -s --http1.0 -D - $BASE/chunked)"
+check "HTTP/1.0 de-chunked body" "hello world" "$(curl -s --http1.0 $BASE/chunked)"
+check "103 Early Hints is relayed" "103" "$(curl -s -D - $BASE/early)"
+check "close-delimited body" "closed" "$(curl -s $BASE/close)"
+check "POST body is echoed" "posted body" "$(curl -s -d 'posted body' $BASE/x)"
+check "Expect: 100-continue" "continued body" "$(curl -s -H 'Expect: 100-continue' -d 'continued body' $BASE/x)"
+check "Transfer-Encoding request is refused" "501" "$(curl -s -D - -H 'Transfer-Encoding: chunked' -d x $BASE/x)"
+
+kill $backend_pid
+sleep 0.5
+check "unreachable backend" "502" "$(curl -s -D - $BASE/x)"
+
+exit $failed
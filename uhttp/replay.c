@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <time.h>
+#include "trace.h"
+
+//replays a trace captured with webserver.c -W against a server, keeping its connections, keep-alive
+//patterns and request bytes, and reports the latency distribution of the replayed requests
+//with -s the trace's timing is sped up by that factor, -s 0 sends everything as fast as the server answers
+
+#define BUFSIZE 65536
+
+struct event {
+	uint64_t time;
+	int type;
+	char *data;
+	int len;
+};
+
+//the events of one traced connection, in the order they were recorded
+struct conn {
+	struct event *events;
+	int n_events, cap_events;
+};
+
+//buffered reader over the connection to the server
+struct reader {
+	int fd;
+	char buf[BUFSIZE];
+	int pos, len;
+};
+
+struct sockaddr_in server;
+struct conn *conns;
+int n_conns = 0;
+double speed = 1;
+uint64_t replay_start;
+
+//latencies of every completed request, in nanoseconds
+//connection threads are detached and count themselves in n_finished, so only the ones still running exist at a time
+uint64_t *samples;
+int n_samples = 0, cap_samples = 0, n_errors = 0, n_reconnects = 0, n_finished = 0;
+pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+
+void error(char *msg) {
+	printf("Error %s\n", msg);
+	exit(-1);
+}
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//sleep until the replayed equivalent of trace time t
+void wait_until(uint64_t t) {
+	uint64_t target, now;
+	struct timespec ts;
+	
+	if(speed <= 0) return;
+	target = replay_start + (uint64_t)(t / speed);
+	now = monotonic_ns();
+	if(now >= target) return;
+	
+	ts.tv_sec = (target - now) / 1000000000;
+	ts.tv_nsec = (target - now) % 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+//read the whole trace into memory and split it into connections
+void load_trace(char *path) {
+	FILE *fp;
+	char magic[8];
+	struct trace_record record;
+	struct conn *c;
+	int cap_conns = 0;
+	
+	fp = fopen(path, "r");
+	if(fp == NULL) error("opening trace");
+	if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) error("not a trace file");
+	
+	//a trace cut short by the server being stopped just ends at the last complete record
+	while(fread(&record, sizeof(record), 1, fp) == 1) {
+		if(record.conn >= (uint32_t)cap_conns) {
+			int old = cap_conns;
+			while(record.conn >= (uint32_t)cap_conns) cap_conns = cap_conns ? cap_conns * 2 : 64;
+			conns = realloc(conns, sizeof(struct conn) * cap_conns);
+			memset(conns + old, 0, sizeof(struct conn) * (cap_conns - old));
+		}
+		if((int)record.conn >= n_conns) n_conns = record.conn + 1;
+		
+		c = &conns[record.conn];
+		if(c->n_events == c->cap_events) {
+			c->cap_events = c->cap_events ? c->cap_events * 2 : 8;
+			c->events = realloc(c->events, sizeof(struct event) * c->cap_events);
+		}
+		
+		c->events[c->n_events].time = record.time;
+		c->events[c->n_events].type = record.type;
+		c->events[c->n_events].len = record.len;
+		c->events[c->n_events].data = NULL;
+		if(record.len > 0) {
+			c->events[c->n_events].data = malloc(record.len);
+			if(fread(c->events[c->n_events].data, 1, record.len, fp) != record.len) break;
+		}
+		c->n_events++;
+	}
+	
+	fclose(fp);
+}
+
+int connect_server(void) {
+	int fd, optval = 1;
+	
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) error("opening socket");
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	
+	if(connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//send a recorded request, a body the trace only holds the start of is padded out to its Content-Length
+int send_request(int fd, struct event *e) {
+	char *head_end, *value, zeros[4096];
+	long body, have;
+	int n;
+	
+	if(send(fd, e->data, e->len, MSG_NOSIGNAL) != e->len) return -1;
+	
+	head_end = memmem(e->data, e->len, "\r\n\r\n", 4);
+	value = memmem(e->data, e->len, "\r\nContent-Length:", 17);
+	if(head_end == NULL || value == NULL || value > head_end) return 0;
+	
+	body = atol(value + 17);
+	have = e->data + e->len - (head_end + 4);
+	memset(zeros, 0, sizeof(zeros));
+	while(body > have) {
+		n = body - have > (long)sizeof(zeros) ? (int)sizeof(zeros) : body - have;
+		if(send(fd, zeros, n, MSG_NOSIGNAL) != n) return -1;
+		have += n;
+	}
+	return 0;
+}
+
+//consume n bytes of body, or everything up to the connection closing if n is negative
+int skip_body(struct reader *r, long n) {
+	int got;
+	
+	while(n != 0) {
+		if(r->pos == r->len) {
+			r->pos = r->len = 0;
+			got = recv(r->fd, r->buf, BUFSIZE, 0);
+			if(got <= 0) return n < 0 && got == 0 ? 0 : -1;
+			r->len = got;
+		}
+		got = r->len - r->pos;
+		if(n >= 0 && got > n) got = n;
+		r->pos += got;
+		if(n > 0) n -= got;
+	}
+	return 0;
+}
+
+//read one line into line, returns its length without the line ending or -1
+int read_line(struct reader *r, char *line, int size) {
+	int len = 0;
+	
+	while(1) {
+		if(r->pos == r->len) {
+			r->pos = r->len = 0;
+			r->len = recv(r->fd, r->buf, BUFSIZE, 0);
+			if(r->len <= 0) {
+				r->len = 0;
+				return -1;
+			}
+		}
+		if(r->buf[r->pos] == '\n') {
+			r->pos++;
+			if(len > 0 && line[len - 1] == '\r') len--;
+			line[len] = 0;
+			return len;
+		}
+		if(len < size - 1) line[len++] = r->buf[r->pos];
+		r->pos++;
+	}
+}
+
+//read a full response to request, skipping interim 1xx responses
+//returns 0 if the connection stays open, 1 if the server is closing it, or -1 on error
+int read_response(struct reader *r, char *request) {
+	char line[1024];
+	int status, closing, chunked, len;
+	long content_length, chunk;
+	
+	do {
+		do {
+			len = read_line(r, line, sizeof(line));
+		} while(len == 0);
+		if(len < 12 || strncmp(line, "HTTP/1.", 7) != 0) return -1;
+		
+		status = atoi(line + 9);
+		closing = line[7] == '0';
+		chunked = 0;
+		content_length = -1;
+		
+		while((len = read_line(r, line, sizeof(line))) > 0) {
+			if(strncasecmp(line, "Content-Length:", 15) == 0) content_length = atol(line + 15);
+			else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked") != NULL) chunked = 1;
+			else if(strncasecmp(line, "Connection:", 11) == 0) {
+				if(strcasestr(line, "close") != NULL) closing = 1;
+				else if(strcasestr(line, "keep-alive") != NULL) closing = 0;
+			}
+		}
+		if(len < 0) return -1;
+	} while(status / 100 == 1);
+	
+	if(strncmp(request, "HEAD ", 5) == 0 || status == 204 || status == 304) return closing;
+	
+	if(chunked) {
+		while(1) {
+			if(read_line(r, line, sizeof(line)) < 0) return -1;
+			chunk = strtol(line, NULL, 16);
+			if(chunk == 0) break;
+			if(skip_body(r, chunk) < 0 || read_line(r, line, sizeof(line)) != 0) return -1;
+		}
+		while((len = read_line(r, line, sizeof(line))) > 0);
+		return len < 0 ? -1 : closing;
+	}
+	
+	if(content_length < 0) return skip_body(r, -1) < 0 ? -1 : 1;
+	return skip_body(r, content_length) < 0 ? -1 : closing;
+}
+
+//replay one traced connection, reconnecting if the server closes it while the trace still has requests on it
+void *replay_conn(void *arg) {
+	struct conn *c = arg;
+	struct reader *r = malloc(sizeof(struct reader));
+	uint64_t *mine = malloc(sizeof(uint64_t) * (c->n_events + 1));
+	int i, n_mine = 0, errors = 0, reconnects = 0, ret;
+	uint64_t start;
+	
+	r->fd = -1;
+	
+	for(i = 0; i < c->n_events; i++) {
+		struct event *e = &c->events[i];
+		
+		wait_until(e->time);
+		
+		if(e->type == TRACE_CLOSE) {
+			if(r->fd >= 0) close(r->fd);
+			r->fd = -1;
+			continue;
+		}
+		if(e->type != TRACE_REQUEST && r->fd >= 0) continue;
+		
+		if(r->fd < 0) {
+			r->fd = connect_server();
+			r->pos = r->len = 0;
+			if(r->fd < 0) {
+				if(e->type == TRACE_REQUEST) errors++;
+				continue;
+			}
+			if(e->type == TRACE_REQUEST) reconnects++;
+		}
+		if(e->type != TRACE_REQUEST) continue;
+		
+		start = monotonic_ns();
+		ret = send_request(r->fd, e);
+		if(ret == 0) ret = read_response(r, e->data);
+		
+		if(ret < 0) errors++;
+		else mine[n_mine++] = monotonic_ns() - start;
+		if(ret != 0) {
+			close(r->fd);
+			r->fd = -1;
+		}
+	}
+	if(r->fd >= 0) close(r->fd);
+	
+	pthread_mutex_lock(&samples_lock);
+	if(n_samples + n_mine > cap_samples) {
+		while(n_samples + n_mine > cap_samples) cap_samples = cap_samples ? cap_samples * 2 : 4096;
+		samples = realloc(samples, sizeof(uint64_t) * cap_samples);
+	}
+	memcpy(samples + n_samples, mine, sizeof(uint64_t) * n_mine);
+	n_samples += n_mine;
+	n_errors += errors;
+	n_reconnects += reconnects;
+	n_finished++;
+	pthread_cond_signal(&finished_cond);
+	pthread_mutex_unlock(&samples_lock);
+	
+	//the connection's requests aren't needed again, so a long trace's memory shrinks as it is replayed
+	for(i = 0; i < c->n_events; i++) free(c->events[i].data);
+	free(c->events);
+	c->events = NULL;
+	
+	free(mine);
+	free(r);
+	return NULL;
+}
+
+int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	int opt, i, started = 0;
+	double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t elapsed;
+	pthread_attr_t attr;
+	pthread_t thread;
+	
+	while((opt = getopt(argc, argv, "s:")) != -1) {
+		if(opt == 's') speed = atof(optarg);
+		else optind = argc + 1;
+	}
+	
+	if(optind != argc - 3 || speed < 0) {
+		printf("Usage %s <trace> <host> <port #> [-s <speedup, 0 for no delays>]\n", argv[0]);
+		exit(-1);
+	}
+	
+	server.sin_family = AF_INET;
+	server.sin_port = htons(atoi(argv[optind + 2]));
+	if(inet_pton(AF_INET, argv[optind + 1], &server.sin_addr) != 1) error("parsing host address");
+	
+	load_trace(argv[optind]);
+	if(n_conns == 0) error("trace has no connections");
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	
+	//connections are numbered in order of arrival, so starting them in order keeps the trace's timing
+	replay_start = monotonic_ns();
+	for(i = 0; i < n_conns; i++) {
+		if(conns[i].n_events == 0) continue;
+		wait_until(conns[i].events[0].time);
+		if(pthread_create(&thread, &attr, replay_conn, &conns[i]) != 0) error("starting connection thread");
+		started++;
+	}
+	
+	pthread_mutex_lock(&samples_lock);
+	while(n_finished < started) pthread_cond_wait(&finished_cond, &samples_lock);
+	pthread_mutex_unlock(&samples_lock);
+	elapsed = monotonic_ns() - replay_start;
+	
+	printf("%d connections, %d requests, %d errors, %d reconnects in %.2fs\n",
+			started, n_samples, n_errors, n_reconnects, elapsed / 1e9);
+	if(n_samples == 0) return 0;
+	
+	qsort(samples, n_samples, sizeof(uint64_t), compare_samples);
+	for(i = 0; i < 4; i++)
+		printf("p%-5g %10.1f us\n", percentiles[i] * 100, samples[(int)(percentiles[i] * (n_samples - 1))] / 1000.0);
+	printf("max    %10.1f us\n", samples[n_samples - 1] / 1000.0);
+	
+	return 0;
+}
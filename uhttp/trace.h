@@ -0,0 +1,15 @@
+//request trace format, written by webserver.c with -W and read by replay.c
+//a trace is TRACE_MAGIC followed by records, each a trace_record and, for requests, len bytes of the raw request
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "UHTTPTR1"
+
+enum { TRACE_OPEN, TRACE_REQUEST, TRACE_CLOSE };
+
+struct trace_record {
+	uint64_t time;		//nanoseconds since the trace was started
+	uint32_t conn;		//connection the event belongs to, numbered from 0 in order of arrival
+	uint16_t type;
+	uint16_t len;
+};
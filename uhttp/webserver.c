@@ -1,14 +1,62 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <pthread.h>
 #include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <zlib.h>
+#include "http_parse.h"
+#include "trace.h"
 
-#define BUFSIZE 1024
+#define LISTEN_BACKLOG 128
+
+//seconds an idle persistent connection is kept open, and the default number of requests it may carry
+#define KEEPALIVE_TIMEOUT 10
+#define MAX_KEEPALIVE_REQUESTS 100
+
+//reverse proxy limits: upstream servers, idle connections kept per upstream, seconds between health checks
+#define MAX_UPSTREAMS 16
+#define POOL_SIZE 32
+#define HEALTH_INTERVAL 5
+
+//document root snapshot limits: files packed, bytes of serialized response headers per file
+#define MAX_PACK_ENTRIES 4096
+#define PACK_HEAD_SIZE 1536
+#define PACK_MAGIC "UHTTPPK2"
+
+//preload hints: assets listed per html page, pages whose hints are cached, bytes of a Link header value
+#define MAX_HINTS 16
+#define MAX_HINT_PAGES 64
+#define HINT_LINK_SIZE 1024
+
+//client sockets are non-blocking, a send waits at most SEND_TIMEOUT seconds for the client to make room, which
+//is also the grace period before the -M minimum send rate applies, and a response is queued as at most MAX_SEGMENTS pieces
+#define SEND_TIMEOUT 10
+#define MAX_SEGMENTS 8
+
+//phase timing histograms have power of two nanosecond buckets, the last one also catches anything longer
+#define HIST_BUCKETS 40
 
 void error(char *msg) {
 	printf("Error %s\n", msg);
@@ -16,47 +64,250 @@ void error(char *msg) {
 }
 
 int responses = 0;
+int max_requests = MAX_KEEPALIVE_REQUESTS;
 
-//function to ensure entire response is written to client
-void socket_write(int client_sock, char *message, int stream_size) {
-	int bytes_written, unsent_bytes, new_bytes_written;
-	
-	bytes_written = write(client_sock, message, stream_size);
-	if(bytes_written < 0) error("writing to socket");
-	unsent_bytes = stream_size - bytes_written;
-	
-	while(unsent_bytes > 0) {
-		new_bytes_written = write(client_sock, message+bytes_written, unsent_bytes);
-		if(new_bytes_written < 0) error("writing to socket");
-		
-		bytes_written += new_bytes_written;
-		unsent_bytes = stream_size - bytes_written;
-	}
-}
+//minimum bytes/sec a client must accept a response at, 0 for no minimum
+long min_send_rate = 0;
+
+//a response is queued as references to memory that outlives the send, such as the caller's buffers or the
+//snapshot mapping, and ranges of open files, so nothing is copied into a per-connection buffer
+struct segment {
+	char *data;	//NULL for a file range
+	int fd;
+	off_t offset;
+	size_t len;
+};
+
+struct out_queue {
+	int sock;
+	int n;
+	struct segment segs[MAX_SEGMENTS];
+};
+
+//an upstream server that requests under prefix are forwarded to
+//several upstreams may share a prefix, in which case requests go to the healthy one with the fewest active requests
+struct upstream {
+	char prefix[128];
+	int prefix_len;
+	char host[128];		//"<host>:<port>" as given, the Host of requests from clients that didn't send one
+	struct sockaddr_in addr;
+	int idle[POOL_SIZE];	//persistent connections waiting for the next request
+	int n_idle;
+	int active;		//requests currently being forwarded
+	int healthy;
+};
+
+struct upstream upstreams[MAX_UPSTREAMS];
+int n_upstreams = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//buffered reader over an upstream socket, used while parsing response heads and chunked bodies
+struct reader {
+	int fd;
+	char buf[BUFSIZE * 8];
+	int pos, len;
+	int received;	//bytes read since the reader was reset, so a failed exchange shows whether any response arrived
+};
+
+//a document root snapshot is a single file laid out as a pack_header, n_buckets bucket slots holding
+//an entry index + 1 (0 when empty, collisions probe linearly), the pack_entry array, then path, header and body bytes
+//all offsets are from the start of the file so it can be served straight from an mmap
+struct pack_header {
+	char magic[8];
+	uint32_t n_entries;
+	uint32_t n_buckets;
+};
+
+struct pack_entry {
+	uint64_t path_off, head_off, body_off, body_len;
+	uint64_t gzip_head_off, gzip_off, gzip_len;	//gzip_len is 0 if there is no precompressed variant
+	uint32_t path_len, head_len, gzip_head_len, hash;
+	char etag[24];
+};
+
+//the mapped snapshot, if serving with -S
+char *pack = NULL;
+uint32_t *pack_buckets;
+struct pack_entry *pack_entries;
+
+//phases of a request timed by http(), total covers all of them
+enum { PHASE_RECV, PHASE_PARSE, PHASE_OPEN, PHASE_WRITE, PHASE_UPSTREAM, PHASE_TOTAL, N_PHASES };
+char *phase_names[N_PHASES] = { "recv", "parse", "open", "write", "upstream", "total" };
+
+//timestamps of the request a thread is currently serving, only taken if the request was sampled
+struct request_timing {
+	int sampled;
+	uint64_t start, mark;
+	uint64_t phase[N_PHASES];
+};
+
+__thread struct request_timing timing;
+int timing_enabled = 0;
+unsigned int sample_rate = 1, sample_counter = 0;
+uint64_t slow_threshold = 0;	//nanoseconds, 0 disables the slow request log
+uint64_t phase_hist[N_PHASES][HIST_BUCKETS];
+
+//a listening socket and the cpu its accepting thread is pinned to, -1 if unpinned
+//with -C there is one per cpu in the same SO_REUSEPORT group, so each cpu accepts the connections whose packets it received
+struct listener {
+	int sockfd;
+	int cpu;
+};
+
+int cpus[CPU_SETSIZE], n_cpus = 0;
+cpu_set_t cpu_mask;
+
+//same-origin assets referenced by an html page, which are announced in a Link header and read ahead
+//when the page is served so they are warm by the time the browser asks for them
+//hint_cache keeps them per file until its modification time or size changes
+struct preload_hints {
+	char path[256];		//file the hints were scanned from, empty if the cache slot is unused
+	time_t mtime;
+	off_t size;
+	char link[HINT_LINK_SIZE];	//Link header value, empty if the page references no assets
+	int n_assets;
+	char assets[MAX_HINTS][256];	//paths of the assets relative to the working directory
+};
+
+struct preload_hints hint_cache[MAX_HINT_PAGES];
+int next_hint_slot = 0;
+pthread_mutex_t hint_lock = PTHREAD_MUTEX_INITIALIZER;
+int early_hints = 0;
+
+//request trace being captured with -W, connection arrivals, raw requests and closes are appended to it
+FILE *trace_file = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t trace_start;
+unsigned int trace_conns = 0;
 
-int parse_get_request(char*, char**, char**, char**, char**, int *);
 int get_content_length(FILE*);
 void get_content_type(char *, char *);
-void aggregate_response(FILE *, int, char *, int, char *, char *, int);
-void send_error_message(int, int, char *, int);
+int wait_socket(int, short, int);
+void queue_data(struct out_queue *, char *, size_t);
+void queue_file(struct out_queue *, int, off_t, size_t);
+int flush_queue(struct out_queue *);
+int socket_write(int, char *, int);
+int aggregate_response(FILE *, int, char *, int, char *, char *, int, char *);
+int send_error_message(int, int, char *, int);
+void connection_headers(char *, char *, int);
+char *find_head_end(char *, int, int *);
+int request_length(char *, int);
+char *find_header(char *, char *, char *);
 void *http(void *);
+void add_upstream(char *);
+void *health_check(void *);
+struct upstream *select_upstream(char *, int *);
+int proxy_request(int, struct upstream *, char *, int, int *);
+void build_pack(char *);
+void load_pack(char *);
+int serve_from_pack(int, char *, char *, int, char *, int);
+uint64_t monotonic_ns(void);
+int ms_until(uint64_t);
+void timing_mark(int);
+void timing_end(char *);
+void *report_timing(void *);
+void parse_cpu_list(char *);
+int open_listener(int, int);
+void attach_cpu_steering(int);
+void *accept_loop(void *);
+void scan_preload_hints(char *, long, char *, struct preload_hints *);
+int get_preload_hints(char *, char *, FILE *, struct preload_hints *);
+void warm_assets(struct preload_hints *);
+void open_trace(char *);
+void trace_event(uint32_t, int, char *, int);
+void *flush_trace(void *);
 
 
 int main(int argc, char *argv[]) {
-	int sockfd, client_sock;
-	int *sock_ptr;
-	struct sockaddr_in server, client;
-	int clientlen;
+	struct listener *listeners;
+	int i, n_listeners, port;
 	
-	if(argc != 2) {
-		printf("Usage %s <port #>\n", argv[0]);
+	int opt;
+	
+	while((opt = getopt(argc, argv, "P:B:S:T:R:C:K:EW:M:")) != -1) {
+		if(opt == 'P') add_upstream(optarg);
+		else if(opt == 'B') {
+			build_pack(optarg);
+			exit(0);
+		}
+		else if(opt == 'S') load_pack(optarg);
+		else if(opt == 'T') {
+			timing_enabled = 1;
+			slow_threshold = atof(optarg) * 1000000;
+		}
+		else if(opt == 'R') {
+			timing_enabled = 1;
+			sample_rate = atoi(optarg) > 0 ? atoi(optarg) : 1;
+		}
+		else if(opt == 'C') parse_cpu_list(optarg);
+		else if(opt == 'E') early_hints = 1;
+		else if(opt == 'W') open_trace(optarg);
+		else if(opt == 'K') max_requests = atoi(optarg) > 0 ? atoi(optarg) : 1;
+		else if(opt == 'M') min_send_rate = atol(optarg) > 0 ? atol(optarg) : 0;
+		else optind = argc + 1;
+	}
+	
+	if(optind != argc - 1) {
+		printf("Usage %s <port #> [-P <prefix>=<host>:<port>]... [-S <snapshot>] [-T <slow ms>] [-R <sample 1 in n>] [-C <cpu list>] [-K <requests per connection>] [-E] [-W <trace>] [-M <min bytes/sec>]\n", argv[0]);
+		printf("      %s -B <snapshot>\n", argv[0]);
 		exit(-1);
 	}
+	port = atoi(argv[optind]);
+	
+	http_parse_init();
+	
+	//a client that resets mid-response is a failed write on its own connection, not a signal that ends the server
+	signal(SIGPIPE, SIG_IGN);
 	
 	//set up pthread attributes
 	pthread_attr_t attr;
     	pthread_attr_init(&attr);
 	
+	//phase histograms are printed on SIGUSR1, which only the reporting thread may receive
+	if(timing_enabled) {
+		pthread_t reporter;
+		sigset_t usr1;
+		
+		sigemptyset(&usr1);
+		sigaddset(&usr1, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+		pthread_create(&reporter, &attr, report_timing, NULL);
+	}
+	
+	if(n_upstreams > 0) {
+		pthread_t checker;
+		pthread_create(&checker, &attr, health_check, NULL);
+	}
+	
+	if(trace_file != NULL) {
+		pthread_t flusher;
+		pthread_create(&flusher, &attr, flush_trace, NULL);
+	}
+	
+	//one listener pinned to each cpu given with -C, otherwise a single unpinned one
+	//listeners join the reuseport group in order, which is the order the steering program indexes them by
+	n_listeners = n_cpus > 0 ? n_cpus : 1;
+	listeners = malloc(sizeof(struct listener) * n_listeners);
+	for(i = 0; i < n_listeners; i++) {
+		listeners[i].sockfd = open_listener(port, n_cpus > 0);
+		listeners[i].cpu = n_cpus > 0 ? cpus[i] : -1;
+	}
+	if(n_cpus > 1) attach_cpu_steering(listeners[0].sockfd);
+	
+	for(i = 1; i < n_listeners; i++) {
+		pthread_t acceptor;
+		if(pthread_create(&acceptor, &attr, accept_loop, &listeners[i]) != 0) error("starting acceptor thread");
+	}
+	accept_loop(&listeners[0]);
+	
+	return 0;
+}
+
+//create, bind and listen on a server socket for port
+int open_listener(int port, int reuseport) {
+	int sockfd;
+	struct sockaddr_in server;
+	
 	//create/open server socket
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if(sockfd < 0)
@@ -65,77 +316,141 @@ int main(int argc, char *argv[]) {
 	int optval = 1;
 	if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval, sizeof(int)) < 0)
 		error("setting reuseaddr");
+	if(reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0)
+		error("setting reuseport");
 	
 	//populate server info
+	memset(&server, 0, sizeof(server));
 	server.sin_family = AF_INET;
 	server.sin_addr.s_addr = INADDR_ANY;
-	server.sin_port = htons(atoi(argv[1]));
+	server.sin_port = htons(port);
 	
-	//bind server, set listen queue to 3
+	//bind server, set listen queue
 	if(bind(sockfd, (struct sockaddr *)&server, sizeof(server)) < 0)
 		error("binding socket");
 
-	listen(sockfd, 3);
+	if(listen(sockfd, LISTEN_BACKLOG) < 0)
+		error("listening on socket");
 	
-	clientlen = sizeof(client);
+	return sockfd;
+}
+
+//parse a cpu list like "0-3,8" into cpus and cpu_mask
+void parse_cpu_list(char *list) {
+	char *range, *dash;
+	int first, last, cpu;
+	cpu_set_t allowed;
 	
-	while(1) {
+	//threads can't be pinned to cpus outside the process's own affinity, e.g. under taskset or in a container
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) error("getting cpu affinity");
 	
-		client_sock = accept(sockfd, (struct sockaddr *)&client,(socklen_t *)&clientlen);
-		if(client_sock < 0)
-			error("accepting connection");
-		
-		pthread_t runner;
-		
-		//use sock_ptr to avoid race condition when starting thread, don't forget to free at end of http function
-		sock_ptr = malloc(sizeof(int));
-		*sock_ptr = client_sock;		
-		
-		pthread_create(&runner, &attr, http, (void *) sock_ptr);
+	CPU_ZERO(&cpu_mask);
+	for(range = strtok(list, ","); range != NULL; range = strtok(NULL, ",")) {
+		first = last = atoi(range);
+		dash = strchr(range, '-');
+		if(dash != NULL) last = atoi(dash + 1);
+		if(first < 0 || last < first || last >= CPU_SETSIZE) error("parsing cpu list");
 		
+		for(cpu = first; cpu <= last; cpu++) {
+			if(!CPU_ISSET(cpu, &allowed)) {
+				printf("cpu %d is not available to this process\n", cpu);
+				error("parsing cpu list");
+			}
+			if(CPU_ISSET(cpu, &cpu_mask)) continue;
+			CPU_SET(cpu, &cpu_mask);
+			cpus[n_cpus++] = cpu;
+		}
 	}
 }
 
-//this function parses get requests and puts each individual chunk into a string passed into the function by reference
-//if there is an error in the request, return the appropriate error number
-int parse_get_request(char *buffer, char **command, char **uri, char **version, char **ext, int *keep_alive){
-	char *dot;
+//have the kernel hand each new connection to the listener pinned to the cpu that received its packets
+//the classic bpf program maps the current cpu to its listener's index in the group, and anything
+//else (a cpu outside the list) to a listener chosen by cpu number
+void attach_cpu_steering(int sockfd) {
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	int i, len = 0;
 	
-	if(buffer[BUFSIZE - 1] != 0) return 400;
+	code = malloc(sizeof(struct sock_filter) * (2 * n_cpus + 3));
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for(i = 0; i < n_cpus; i++) {
+		code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n_cpus);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
 	
-	*command = strtok(buffer, " \t\n\r");
-	if(*command==NULL) return 400;
-	if(strcmp(*command, "HEAD")==0 || strcmp(*command, "POST")==0) return 405;
-	if(strcmp(*command, "GET")!=0) return 400;
+	prog.len = len;
+	prog.filter = code;
 	
-	*uri = strtok(NULL, " \t\n\r");
-	if(*uri==NULL) return 400;
+	//without steering the kernel still spreads connections over the listeners, and accept_loop
+	//falls back to pinning each connection to the cpu it arrived on
+	if(setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+		printf("could not attach reuseport cpu steering: %s\n", strerror(errno));
 	
-	*version = strtok(NULL, " \t\n\r");
-	if(*version==NULL) return 400;
-	if(strcmp(*version, "HTTP/1.0")!=0 && strcmp(*version, "HTTP/1.1")!=0) return 505;
+	free(code);
+}
+
+//accept connections on a listener and start a thread for each one
+//with -C the thread runs on the cpu that handled the connection's receive queue, so its stack and
+//buffers are first touched, and therefore allocated, on that cpu's numa node
+void *accept_loop(void *arg) {
+	struct listener *l = arg;
+	struct sockaddr_in client;
+	int clientlen, client_sock, incoming_cpu, cpu;
+	int *sock_ptr;
+	socklen_t optlen;
+	cpu_set_t pin;
 	
-	dot = strrchr(*uri, '.');
-	if(dot==NULL) *ext = NULL;
-	else *ext = dot + 1;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	
-	//in the case of http 1.1, we search for a keep-alive request and set a keep-alive flag
-	if(strcmp(*version, "HTTP/1.1")==0) {
-		char *header_field, *hf_prev;
+	if(l->cpu >= 0) {
+		CPU_ZERO(&pin);
+		CPU_SET(l->cpu, &pin);
+		pthread_setaffinity_np(pthread_self(), sizeof(pin), &pin);
+	}
+	
+	clientlen = sizeof(client);
+	
+	while(1) {
+	
+		client_sock = accept(l->sockfd, (struct sockaddr *)&client,(socklen_t *)&clientlen);
+		if(client_sock < 0) {
+			//aborted connections and running out of descriptors or memory only cost the connection being accepted
+			if(errno == EBADF || errno == EINVAL || errno == ENOTSOCK) error("accepting connection");
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) usleep(10000);
+			continue;
+		}
+		
+		pthread_t runner;
+		
+		//use sock_ptr to avoid race condition when starting thread, don't forget to free at end of http function
+		sock_ptr = malloc(sizeof(int));
+		*sock_ptr = client_sock;		
 		
-		header_field = strtok(NULL, "\r\n");
-		while(header_field!=NULL) {
-			hf_prev = header_field;
-			header_field = strtok(NULL, "\r\n");
+		if(l->cpu >= 0) {
+			//steering can be off, e.g. when the program couldn't be attached, so trust where the packets actually landed
+			cpu = l->cpu;
+			optlen = sizeof(incoming_cpu);
+			if(getsockopt(client_sock, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &optlen) == 0
+					&& incoming_cpu >= 0 && incoming_cpu < CPU_SETSIZE && CPU_ISSET(incoming_cpu, &cpu_mask))
+				cpu = incoming_cpu;
 			
-			if(strcmp(hf_prev, "Connection: Keep-alive")==0) {
-				*keep_alive = 1;
-				break;
-			}
+			CPU_ZERO(&pin);
+			CPU_SET(cpu, &pin);
+			pthread_attr_setaffinity_np(&attr, sizeof(pin), &pin);
+		}
+		
+		//without a thread nothing would ever answer or close the connection
+		if(pthread_create(&runner, &attr, http, (void *) sock_ptr) != 0) {
+			close(client_sock);
+			free(sock_ptr);
 		}
 	}
 	
-	return 0;
+	return NULL;
 }
 
 int get_content_length(FILE *fp) {
@@ -165,27 +480,126 @@ void get_content_type(char *content_type, char *ext) {
 	else strcpy(content_type, "text/plain");
 }
 
-//this function bundles together the full response and sends it
-void aggregate_response(FILE *fp, int client_sock, char *size_c, int size, char *content_type, char *version, int keep_alive) {
-	char buf[size + 512];
-	char contents[size];
-	int header_size;
-	int stream_size;
-	int bytes_read, unread_bytes, new_bytes_read;
+//wait until fd is ready for events, returns 0 once it is, or -1 on timeout
+int wait_socket(int fd, short events, int timeout_ms) {
+	struct pollfd pfd;
+	int n;
 	
-	bytes_read = fread(contents, 1, size, fp);
-	if(bytes_read < 0) error("reading file");
+	pfd.fd = fd;
+	pfd.events = events;
+	do n = poll(&pfd, 1, timeout_ms);
+	while(n < 0 && errno == EINTR);
 	
-	//make sure entire file is read
-	unread_bytes = size - bytes_read;
-	while(unread_bytes > 0) {
-		new_bytes_read = fread(contents, 1, unread_bytes, fp);
-		if(new_bytes_read < 0) error("writing to socket");
+	return n > 0 ? 0 : -1;
+}
+
+void queue_data(struct out_queue *q, char *data, size_t len) {
+	if(len == 0) return;
+	if(q->n == MAX_SEGMENTS) error("programmer queued too many segments, :(");
+	
+	q->segs[q->n].data = data;
+	q->segs[q->n++].len = len;
+}
+
+void queue_file(struct out_queue *q, int fd, off_t offset, size_t len) {
+	if(len == 0) return;
+	if(q->n == MAX_SEGMENTS) error("programmer queued too many segments, :(");
+	
+	q->segs[q->n].data = NULL;
+	q->segs[q->n].fd = fd;
+	q->segs[q->n].offset = offset;
+	q->segs[q->n++].len = len;
+}
+
+//send everything queued, consecutive memory segments in one sendmsg and file ranges with sendfile
+//whenever the socket is full, wait for the client to drain it, but give up once it has made no progress for
+//SEND_TIMEOUT seconds or, with -M, has fallen behind the minimum rate after the grace period
+//returns 0 once everything is sent, or -1 if the connection should be closed
+int flush_queue(struct out_queue *q) {
+	struct iovec iov[MAX_SEGMENTS];
+	struct msghdr msg;
+	struct segment *s;
+	int first = 0, iovcnt;
+	ssize_t n;
+	off_t offset;
+	uint64_t start, progress, deadline, now, sent = 0, timeout = (uint64_t)SEND_TIMEOUT * 1000000000;
+	
+	start = progress = monotonic_ns();
+	
+	while(first < q->n) {
+		s = &q->segs[first];
+		if(s->data != NULL) {
+			memset(&msg, 0, sizeof(msg));
+			for(iovcnt = 0; first + iovcnt < q->n && s[iovcnt].data != NULL; iovcnt++) {
+				iov[iovcnt].iov_base = s[iovcnt].data;
+				iov[iovcnt].iov_len = s[iovcnt].len;
+			}
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iovcnt;
+			
+			//headers followed by a file range are held back so they leave in the same packet as the start of the body
+			n = sendmsg(q->sock, &msg, MSG_NOSIGNAL | (first + iovcnt < q->n ? MSG_MORE : 0));
+		}
+		else {
+			offset = s->offset;
+			n = sendfile(q->sock, s->fd, &offset, s->len);
+			
+			//the file was truncated since its length was sent
+			if(n == 0) return -1;
+		}
 		
-		bytes_read += new_bytes_read;
-		unread_bytes = size - bytes_read;
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+			
+			deadline = progress + timeout;
+			if(min_send_rate > 0 && start + timeout + sent * 1000000000 / min_send_rate < deadline)
+				deadline = start + timeout + sent * 1000000000 / min_send_rate;
+			
+			now = monotonic_ns();
+			if(now >= deadline || wait_socket(q->sock, POLLOUT, (deadline - now) / 1000000 + 1) < 0) return -1;
+			continue;
+		}
+		sent += n;
+		progress = monotonic_ns();
+		
+		//step past fully sent segments and into a partially sent one
+		while(n > 0) {
+			s = &q->segs[first];
+			if((size_t)n >= s->len) {
+				n -= s->len;
+				first++;
+			}
+			else {
+				if(s->data != NULL) s->data += n;
+				else s->offset += n;
+				s->len -= n;
+				n = 0;
+			}
+		}
 	}
 	
+	q->n = 0;
+	return 0;
+}
+
+//function to ensure entire response is written to client, returns -1 if the client is gone or too slow
+int socket_write(int client_sock, char *message, int stream_size) {
+	struct out_queue q;
+	
+	q.sock = client_sock;
+	q.n = 0;
+	queue_data(&q, message, stream_size);
+	return flush_queue(&q);
+}
+
+//this function bundles together the full response and sends it
+//link is the value of a Link header to add, or NULL
+//the body is sent straight from the file, returns -1 if the connection should be closed
+int aggregate_response(FILE *fp, int client_sock, char *size_c, int size, char *content_type, char *version, int keep_alive, char *link) {
+	char buf[512 + (link == NULL ? 0 : strlen(link))];
+	struct out_queue q;
+	
 	//form header
 	strcpy(buf, version);
 	strcat(buf, " 200 OK\r\n");
@@ -195,27 +609,28 @@ void aggregate_response(FILE *fp, int client_sock, char *size_c, int size, char
 	strcat(buf, "Content-Length: ");
 	strcat(buf, size_c);
 	strcat(buf, "\r\n");
-	
-	//add persistent connection info if http 1.1
-	if(strcmp(version, "HTTP/1.1")==0) {
-		if(keep_alive==0) strcat(buf, "Connection: Close\r\n\r\n");
-		else if(keep_alive==1) strcat(buf, "Connection: Keep-alive\r\n\r\n");
-	} else {
+	if(link != NULL) {
+		strcat(buf, "Link: ");
+		strcat(buf, link);
 		strcat(buf, "\r\n");
 	}
 	
-	//copy contents
-	header_size = strlen(buf);
-	stream_size = size + header_size;
-	memcpy(buf+header_size, contents, size);
-	strcpy(buf + stream_size, "\r\n\r\n");
+	connection_headers(buf, version, keep_alive);
 	
-	socket_write(client_sock, buf, stream_size+4);	//add 4 to stream_size since we added crlf
+	q.sock = client_sock;
+	q.n = 0;
+	queue_data(&q, buf, strlen(buf));
+	queue_file(&q, fileno(fp), 0, size);
+	if(flush_queue(&q) < 0) return -1;
+	
+	timing_mark(PHASE_WRITE);
 	responses++;
 	printf("send response %d from server\n", responses);
+	return 0;
 }
 
-void send_error_message(int client_sock, int err, char *version, int keep_alive) {
+//returns -1 if the connection should be closed
+int send_error_message(int client_sock, int err, char *version, int keep_alive) {
 	char message[256];
 	int stream_size;
 	if(version == NULL) strcpy(message, "HTTP/1.1");
@@ -225,18 +640,65 @@ void send_error_message(int client_sock, int err, char *version, int keep_alive)
 	else if(err==403) strcat(message, " 403 Forbidden\r\n");
 	else if(err==404) strcat(message, " 404 Not Found\r\n");
 	else if(err==405) strcat(message, " 405 Method Not Allowed\r\n");
+	else if(err==501) strcat(message, " 501 Not Implemented\r\n");
+	else if(err==502) strcat(message, " 502 Bad Gateway\r\n");
 	else if(err==505) strcat(message, " 505 HTTP Version Not Supported\r\n");
 	else error("programmer messed up error codes, :(");
 	
-	if(version!=NULL && strcmp(version, "HTTP/1.1")==0) {
-		if(keep_alive==0) strcat(message, "Connection: Close\r\n\r\n");
-		else if(keep_alive==1) strcat(message, "Connection: Keep-alive\r\n\r\n");
-	} else {
-		strcat(message, "\r\n");
-	}
+	//an explicit empty body, otherwise the client has to wait for the connection to close to know the response is over
+	strcat(message, "Content-Length: 0\r\n");
+	connection_headers(message, version == NULL ? "HTTP/1.1" : version, keep_alive);
 	
 	stream_size = strlen(message);
-	socket_write(client_sock, message, stream_size);
+	if(socket_write(client_sock, message, stream_size) < 0) return -1;
+	timing_mark(PHASE_WRITE);
+	return 0;
+}
+
+//add the persistence headers and the empty line that ends a response head
+//keep_alive is the number of further requests the connection will take, 0 if it closes after this response
+void connection_headers(char *buf, char *version, int keep_alive) {
+	if(keep_alive > 0)
+		sprintf(buf + strlen(buf), "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n", KEEPALIVE_TIMEOUT, keep_alive);
+	else if(strcmp(version, "HTTP/1.1")==0)
+		strcat(buf, "Connection: close\r\n");
+	strcat(buf, "\r\n");
+}
+
+//find the empty line that ends a request's head, returns a pointer to it or NULL if the head is incomplete
+//*head_len is set to the length of the head including the empty line
+char *find_head_end(char *buffer, int len, int *head_len) {
+	char *crlf, *lf;
+	
+	//requests from simple clients may end their lines with a bare '\n'
+	crlf = memmem(buffer, len, "\r\n\r\n", 4);
+	lf = memmem(buffer, len, "\n\n", 2);
+	if(crlf == NULL && lf == NULL) return NULL;
+	
+	if(lf == NULL || (crlf != NULL && crlf < lf)) {
+		*head_len = crlf + 4 - buffer;
+		return crlf;
+	}
+	*head_len = lf + 2 - buffer;
+	return lf;
+}
+
+//length of the first request in buffer, including as much of its body as has arrived
+//returns 0 if its headers aren't complete yet
+int request_length(char *buffer, int len) {
+	char *head_end, *value;
+	long long body = 0;
+	int head_len;
+	
+	head_end = find_head_end(buffer, len, &head_len);
+	if(head_end == NULL) return 0;
+	
+	value = find_header(buffer, head_end, "Content-Length");
+	if(value != NULL) body = strtoll(value, NULL, 10);
+	if(body < 0) body = 0;
+	if(body > len - head_len) body = len - head_len;
+	
+	return head_len + body;
 }
 
 void* http(void *cs) {
@@ -244,39 +706,123 @@ void* http(void *cs) {
 	free(cs);
 	
 	char buffer[BUFSIZE]; //error check overflows to this
-	char *command, *uri, *version, *ext, *uri_index;
+	char *command, *uri, *version, *ext, *uri_index, *if_none_match;
 	FILE *fp;
 	int file_size;
 	char size_c[sizeof(long long int) + 1];
 	char content_type[32];
 	int err, index_flag = 0;
-	int keep_alive = 0;
+	int keep_alive = 0, accept_gzip, has_hints;
+	char next_byte;
+	struct preload_hints hints;
+	int buffered = 0, request_len = 0, bytes_received = 0, proxied, requests = 0;
+	struct upstream *up;
+	uint32_t conn_id = 0;
+	uint64_t deadline;
 	
-	//set keep_alive to 1 if persistent connections, loop based on keep_alive==1
+	//a slow client only ever blocks this connection, reads and writes wait in poll with a timeout
+	fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) | O_NONBLOCK);
+	
+	if(trace_file != NULL) {
+		conn_id = __atomic_fetch_add(&trace_conns, 1, __ATOMIC_RELAXED);
+		trace_event(conn_id, TRACE_OPEN, NULL, 0);
+	}
+	
+	//keep_alive counts the further requests a persistent connection will take, loop while it is above 0
 	do {
-		bzero(buffer, BUFSIZE);
+		//pipelined bytes that followed the previous request are kept for the next one
+		buffered -= request_len;
+		memmove(buffer, buffer + request_len, buffered);
+		bzero(buffer + buffered, BUFSIZE - buffered);
+		request_len = request_length(buffer, buffered);
+		
 		command = uri = version = ext = uri_index = NULL;
 		index_flag = 0;
-		keep_alive = 0;
+		keep_alive = accept_gzip = 0;
+		if_none_match = NULL;
+		
+		//a request's head must arrive within KEEPALIVE_TIMEOUT seconds, on a new connection as on an idle persistent one,
+		//so a client that stops partway or trickles its head can't hold the thread
+		deadline = monotonic_ns() + KEEPALIVE_TIMEOUT * 1000000000ULL;
+		
+		//for a sampled request, wait for it to arrive before starting the clock so the idle time
+		//between keep-alive requests isn't counted
+		timing.sampled = timing_enabled && __atomic_fetch_add(&sample_counter, 1, __ATOMIC_RELAXED) % sample_rate == 0;
+		if(timing.sampled) {
+			if(request_len == 0 && wait_socket(client_sock, POLLIN, ms_until(deadline)) < 0) break;
+			
+			memset(timing.phase, 0, sizeof(timing.phase));
+			timing.start = timing.mark = monotonic_ns();
+		}
+		
+		//read until the request's headers are complete, a request that fills the buffer without ending is rejected by the parser
+		while(request_len == 0 && buffered < BUFSIZE) {
+			bytes_received = recv(client_sock, buffer + buffered, BUFSIZE - buffered, 0);
+			
+			if(bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				if(wait_socket(client_sock, POLLIN, ms_until(deadline)) < 0) break;
+				continue;
+			}
+			if(bytes_received <= 0) break;
+			buffered += bytes_received;
+			request_len = request_length(buffer, buffered);
+		}
 		
 		//sometimes an empty message is received, ignore these and erroneous calls
-		if(recv(client_sock, buffer, BUFSIZE, 0) <= 0) {
-			break;
+		if(request_len == 0) {
+			if(buffered < BUFSIZE) break;
+			request_len = buffered;
 		}
+		requests++;
+		timing_mark(PHASE_RECV);
 		
-		//set up socket timeout
-		struct timeval timeout;
-		timeout.tv_sec = 10;
-		timeout.tv_usec = 0;
-	
-		if (setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO,&timeout,sizeof(timeout)) < 0)
-			error("setting timeout on socket");
+		//record the request before parsing writes into the buffer
+		if(trace_file != NULL) trace_event(conn_id, TRACE_REQUEST, buffer, request_len);
+		
+		//requests under a configured prefix are forwarded to an upstream instead of being served from www
+		if(n_upstreams > 0) {
+			up = select_upstream(buffer, &proxied);
+			if(proxied) {
+				//the client's connection persists by its own request and the -K limit, whatever the upstream's does
+				keep_alive = requests < max_requests ? max_requests - requests : 0;
+				if(up == NULL) err = 502;
+				else err = proxy_request(client_sock, up, buffer, request_len, &keep_alive);
+				
+				timing_mark(PHASE_UPSTREAM);
+				if(err > 0) send_error_message(client_sock, err, NULL, 0);
+				if(err != 0) keep_alive = 0;
+				timing_end(NULL);
+				continue;
+			}
+		}
 		
 		//parse_get_request returns any relevant error codes
-		err = parse_get_request(buffer, &command, &uri, &version, &ext, &keep_alive);
+		//the byte after this request may start the next pipelined one, it is put back once parsing is done
+		next_byte = 0;
+		if(request_len < BUFSIZE) {
+			next_byte = buffer[request_len];
+			buffer[request_len] = 0;
+		}
+		err = parse_get_request(buffer, request_len, &command, &uri, &version, &ext, &keep_alive, &accept_gzip, &if_none_match);
+		if(request_len < BUFSIZE) buffer[request_len] = next_byte;
+		timing_mark(PHASE_PARSE);
+		
+		//after a malformed request the rest of the stream can't be trusted, so close once the error is sent
+		if(err==400 || err==505) keep_alive = 0;
+		if(keep_alive) keep_alive = requests < max_requests ? max_requests - requests : 0;
+		
+		//with a snapshot loaded every lookup is answered from the mapping, the filesystem is never touched
+		if(err==0 && pack != NULL) {
+			err = serve_from_pack(client_sock, uri, version, keep_alive, if_none_match, accept_gzip);
+			if(err<=0) {
+				if(err<0) keep_alive = 0;
+				timing_end(uri);
+				continue;
+			}
+		}
 		
 		//if no errors, do some string manipulation in the case directory is addressed
-		if(err==0) {
+		if(err==0 && pack == NULL) {
 			//uri_index holds value of uri we will open
 			//we use this in case we access a directory
 			//which should return the directory name + 'index.html'
@@ -304,11 +850,13 @@ void* http(void *cs) {
 					else err = 404;
 				}
 			}
-			free(uri_index);
+			timing_mark(PHASE_OPEN);
 		}
 		
 		if(err!=0) {
-			send_error_message(client_sock, err, version, keep_alive);
+			free(uri_index);
+			if(send_error_message(client_sock, err, version, keep_alive) < 0) keep_alive = 0;
+			timing_end(uri);
 			continue;
 		}
 		
@@ -317,18 +865,1194 @@ void* http(void *cs) {
 		sprintf(size_c, "%d", file_size);
 		
 		get_content_type(content_type, ext);
+		
+		//for html pages, announce the assets the browser is about to ask for and start reading them from disk
+		//with -E they are also sent as 103 early hints, before the page itself is read
+		has_hints = 0;
+		if(index_flag || strcmp(content_type, "text/html")==0) {
+			has_hints = get_preload_hints(uri_index, uri, fp, &hints);
+			if(has_hints && early_hints && strcmp(version, "HTTP/1.1")==0) {
+				char early[HINT_LINK_SIZE + 64];
+				sprintf(early, "HTTP/1.1 103 Early Hints\r\nLink: %s\r\n\r\n", hints.link);
+				if(socket_write(client_sock, early, strlen(early)) < 0) {
+					free(uri_index);
+					fclose(fp);
+					keep_alive = 0;
+					timing_end(uri);
+					continue;
+				}
+			}
+			if(has_hints) warm_assets(&hints);
+		}
+		free(uri_index);
 	
 		//since ext is NULL, content type is automatically set as text/plain, but for requests to a directory
 		//we must send index.html as text/html if it exists
-		if(!index_flag) aggregate_response(fp, client_sock, size_c, file_size, content_type, version, keep_alive);
-		else aggregate_response(fp, client_sock, size_c, file_size, "text/html", version, keep_alive);
+		if(!index_flag) err = aggregate_response(fp, client_sock, size_c, file_size, content_type, version, keep_alive, has_hints ? hints.link : NULL);
+		else err = aggregate_response(fp, client_sock, size_c, file_size, "text/html", version, keep_alive, has_hints ? hints.link : NULL);
+		if(err < 0) keep_alive = 0;
 	
 	
 		fclose(fp);
+		timing_end(uri);
+		
+	} while(keep_alive > 0);
+	
+	if(trace_file != NULL) trace_event(conn_id, TRACE_CLOSE, NULL, 0);
+	//a failed close only concerns this connection, the descriptor is released either way
+	if(close(client_sock) < 0) printf("Error closing socket %d: %s\n", client_sock, strerror(errno));
+	
+	return NULL;
+}
+
+//parse a "-P <prefix>=<host>:<port>" argument and register the upstream
+void add_upstream(char *arg) {
+	char *spec = strdup(arg), *eq, *colon;
+	struct addrinfo hints, *res;
+	struct upstream *u;
+	
+	if(n_upstreams == MAX_UPSTREAMS) error("too many upstreams");
+	
+	eq = strchr(spec, '=');
+	colon = strrchr(spec, ':');
+	if(eq == NULL || colon == NULL || colon < eq || eq - spec >= (int)sizeof(u->prefix) || spec[0] != '/')
+		error("parsing upstream, expected <prefix>=<host>:<port>");
+	*eq = *colon = 0;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(eq + 1, colon + 1, &hints, &res) != 0)
+		error("resolving upstream");
+	
+	u = &upstreams[n_upstreams++];
+	memset(u, 0, sizeof(*u));
+	strcpy(u->prefix, spec);
+	u->prefix_len = strlen(spec);
+	snprintf(u->host, sizeof(u->host), "%s:%s", eq + 1, colon + 1);
+	memcpy(&u->addr, res->ai_addr, sizeof(u->addr));
+	u->healthy = 1;
+	
+	freeaddrinfo(res);
+	free(spec);
+}
+
+//open a fresh connection to an upstream, returns -1 if it can't be reached
+int upstream_connect(struct upstream *u) {
+	int fd, optval = 1;
+	struct timeval timeout;
+	
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) return -1;
+	
+	//the send timeout also bounds connect, so a dead upstream can't hang the request
+	timeout.tv_sec = 2;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	
+	if(connect(fd, (struct sockaddr *)&u->addr, sizeof(u->addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	
+	timeout.tv_sec = 30;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+//periodically probe every upstream and drop pooled connections the upstream has since closed
+void *health_check(void *unused) {
+	int i, j, fd, alive;
+	struct upstream *u;
+	struct pollfd pfd;
+	
+	pthread_detach(pthread_self());
+	
+	while(1) {
+		sleep(HEALTH_INTERVAL);
+		
+		for(i = 0; i < n_upstreams; i++) {
+			u = &upstreams[i];
+			
+			fd = upstream_connect(u);
+			alive = fd >= 0;
+			if(alive) close(fd);
+			
+			pthread_mutex_lock(&pool_lock);
+			if(u->healthy != alive) printf("upstream %s -> %s:%d is %s\n", u->prefix,
+					inet_ntoa(u->addr.sin_addr), ntohs(u->addr.sin_port), alive ? "up" : "down");
+			u->healthy = alive;
+			
+			//an idle connection should never be readable, if it is the upstream closed it or sent junk
+			for(j = 0; j < u->n_idle; j++) {
+				pfd.fd = u->idle[j];
+				pfd.events = POLLIN;
+				if(!alive || poll(&pfd, 1, 0) != 0) {
+					close(u->idle[j]);
+					u->idle[j--] = u->idle[--u->n_idle];
+				}
+			}
+			pthread_mutex_unlock(&pool_lock);
+		}
+	}
+	
+	return NULL;
+}
+
+//find the upstream for the request in buffer, *matched is set if the uri falls under any proxy prefix
+//the longest matching prefix wins, and among its healthy upstreams the one with the fewest active requests
+//returns NULL if the uri matched but no upstream is healthy
+struct upstream *select_upstream(char *buffer, int *matched) {
+	char *uri, *end;
+	int i, uri_len, best_len = 0;
+	struct upstream *best = NULL;
+	
+	*matched = 0;
+	
+	uri = memchr(buffer, ' ', BUFSIZE);
+	if(uri == NULL) return NULL;
+	uri++;
+	for(end = uri; end < buffer + BUFSIZE && strchr(" \t\r\n?", *end) == NULL; end++);
+	uri_len = end - uri;
+	
+	pthread_mutex_lock(&pool_lock);
+	for(i = 0; i < n_upstreams; i++) {
+		struct upstream *u = &upstreams[i];
+		
+		if(u->prefix_len > uri_len || u->prefix_len < best_len || strncmp(uri, u->prefix, u->prefix_len) != 0)
+			continue;
+		
+		//"/api" should match "/api" and "/api/x", but not "/apix"
+		if(u->prefix[u->prefix_len - 1] != '/' && uri_len > u->prefix_len && uri[u->prefix_len] != '/')
+			continue;
+		
+		if(u->prefix_len > best_len) best = NULL;
+		best_len = u->prefix_len;
+		*matched = 1;
+		
+		if(u->healthy && (best == NULL || u->active < best->active)) best = u;
+	}
+	if(best != NULL) best->active++;
+	pthread_mutex_unlock(&pool_lock);
+	
+	return best;
+}
+
+//take an idle pooled connection if there is one, otherwise connect
+int upstream_acquire(struct upstream *u, int *reused) {
+	int fd = -1;
+	
+	pthread_mutex_lock(&pool_lock);
+	if(u->n_idle > 0) fd = u->idle[--u->n_idle];
+	pthread_mutex_unlock(&pool_lock);
+	
+	*reused = fd >= 0;
+	if(fd < 0) {
+		fd = upstream_connect(u);
+		if(fd < 0) {
+			pthread_mutex_lock(&pool_lock);
+			u->healthy = 0;
+			pthread_mutex_unlock(&pool_lock);
+		}
+	}
+	return fd;
+}
+
+//return a connection to the pool if the last exchange left it reusable, and finish the request
+void upstream_release(struct upstream *u, int fd, int reusable) {
+	pthread_mutex_lock(&pool_lock);
+	u->active--;
+	if(fd >= 0 && reusable && u->healthy && u->n_idle < POOL_SIZE) {
+		u->idle[u->n_idle++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	
+	if(fd >= 0) close(fd);
+}
+
+//like socket_write for relayed data, which arrives at the upstream's pace so only a stalled peer is given up on
+int send_all(int fd, char *data, int len) {
+	int n;
+	
+	while(len > 0) {
+		n = send(fd, data, len, MSG_NOSIGNAL);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if(wait_socket(fd, POLLOUT, SEND_TIMEOUT * 1000) < 0) return -1;
+			continue;
+		}
+		if(n <= 0) return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//move len bytes from one socket to another through a pipe, so the body never passes through user space
+//a negative len relays until from reaches end of file
+int splice_relay(int from, int to, long long len) {
+	int pipefd[2];
+	ssize_t in, out;
+	int ret = 0;
+	
+	if(len == 0) return 0;
+	if(pipe(pipefd) < 0) return -1;
+	
+	while(len != 0) {
+		in = splice(from, NULL, pipefd[1], NULL, (len < 0 || len > 65536) ? 65536 : len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		
+		//the client socket is non-blocking, either end of the relay may be it
+		if(in < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if(wait_socket(from, POLLIN, SEND_TIMEOUT * 1000) < 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		if(in <= 0) {
+			if(in < 0 || len > 0) ret = -1;
+			break;
+		}
+		if(len > 0) len -= in;
 		
-	} while(keep_alive == 1);
+		//the last piece goes out without SPLICE_F_MORE, which would otherwise hold it back in the hope of more data
+		while(in > 0) {
+			out = splice(pipefd[0], NULL, to, NULL, in, SPLICE_F_MOVE | (len != 0 ? SPLICE_F_MORE : 0));
+			if(out < 0 && (errno == EAGAIN || errno == EINTR)) {
+				if(wait_socket(to, POLLOUT, SEND_TIMEOUT * 1000) < 0) {
+					ret = -1;
+					goto done;
+				}
+				continue;
+			}
+			if(out <= 0) {
+				ret = -1;
+				goto done;
+			}
+			in -= out;
+		}
+	}
+	
+done:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return ret;
+}
+
+//read more upstream bytes into the reader, returns the number of bytes read
+int reader_fill(struct reader *r) {
+	int n;
+	
+	if(r->pos > 0) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	if(r->len == sizeof(r->buf)) return -1;
+	
+	n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+	if(n > 0) {
+		r->len += n;
+		r->received += n;
+	}
+	return n;
+}
+
+//find header value in the header lines between head and head_end, returns a pointer to the value or NULL
+//lines may end in "\r\n" or a bare '\n' and nothing at or past head_end is read, so the head needn't be nul terminated
+char *find_header(char *head, char *head_end, char *name) {
+	int name_len = strlen(name);
+	char *line = memchr(head, '\n', head_end - head);
+	
+	while(line != NULL) {
+		line++;
+		if(head_end - line > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+			line += name_len + 1;
+			while(line < head_end && (*line == ' ' || *line == '\t')) line++;
+			return line;
+		}
+		line = memchr(line, '\n', head_end - line);
+	}
+	return NULL;
+}
+
+//copy the header lines in [line, head_end) to out with "\r\n" endings, leaving out Connection and Keep-Alive, which
+//only apply to one hop, and noting the Connection options they carried, returns the number of bytes written
+//the header named by drop is also left out, unless it is NULL
+int copy_headers(char *out, char *line, char *head_end, char *drop, int *conn_close, int *conn_keep_alive) {
+	char *eol, *end, *colon;
+	int len = 0, drop_len = drop == NULL ? 0 : strlen(drop);
+	
+	while(line < head_end) {
+		eol = memchr(line, '\n', head_end - line);
+		if(eol == NULL) eol = head_end;
+		end = eol;
+		if(end > line && end[-1] == '\r') end--;
+		colon = memchr(line, ':', end - line);
+		
+		if(colon != NULL && colon - line == 10 && strncasecmp(line, "Connection", 10) == 0) {
+			parse_connection(colon + 1, end, conn_close, conn_keep_alive);
+		}
+		else if(colon == NULL || !((colon - line == 10 && strncasecmp(line, "Keep-Alive", 10) == 0)
+				|| (drop != NULL && colon - line == drop_len && strncasecmp(line, drop, drop_len) == 0))) {
+			memcpy(out + len, line, end - line);
+			len += end - line;
+			memcpy(out + len, "\r\n", 2);
+			len += 2;
+		}
+		line = eol + 1;
+	}
+	return len;
+}
+
+//read the next response head from the upstream into the reader, starting at r->pos
+//returns its status and sets *head_len, or returns -1 if the upstream closed or sent something that isn't a response
+int read_head(struct reader *r, int *head_len) {
+	char *head_end;
+	
+	while((head_end = memmem(r->buf + r->pos, r->len - r->pos, "\r\n\r\n", 4)) == NULL)
+		if(reader_fill(r) <= 0) return -1;
+	
+	*head_len = head_end + 4 - (r->buf + r->pos);
+	if(*head_len < 16 || strncmp(r->buf + r->pos, "HTTP/1.", 7) != 0) return -1;
+	return atoi(r->buf + r->pos + 9);
+}
+
+//pass interim 1xx responses such as 100 Continue or 103 Early Hints on to the client as they arrive
+//stops at the final response, or at a 100 Continue if until_continue is set, leaving its head unsent at r->pos
+//an http 1.0 client can't be sent interim responses, so unless forward is set they are read and dropped
+//returns the status of that head, -1 if the upstream failed, or -2 if the client did
+int relay_interim(struct reader *r, int client_sock, int forward, int until_continue, int *head_len) {
+	int status;
+	
+	while(1) {
+		status = read_head(r, head_len);
+		
+		//101 hands the connection over to another protocol, so nothing follows it
+		if(status / 100 != 1 || status == 101 || (until_continue && status == 100)) return status;
+		
+		if(forward && send_all(client_sock, r->buf + r->pos, *head_len) < 0) return -2;
+		r->pos += *head_len;
+	}
+}
+
+//forward a chunked body to the client as it arrives, up to and including the last chunk and trailers
+//with dechunk set only the chunk data is sent, for an http 1.0 client whose response ends when the connection closes
+int relay_chunked(struct reader *r, int client_sock, int dechunk) {
+	char *eol;
+	long long chunk, data;
+	int line_len, n;
+	
+	while(1) {
+		//chunk size line
+		while((eol = memmem(r->buf + r->pos, r->len - r->pos, "\r\n", 2)) == NULL)
+			if(reader_fill(r) <= 0) return -1;
+		
+		line_len = eol + 2 - (r->buf + r->pos);
+		chunk = strtoll(r->buf + r->pos, NULL, 16);
+		if(!dechunk && send_all(client_sock, r->buf + r->pos, line_len) < 0) return -1;
+		r->pos += line_len;
+		
+		//last chunk is followed by optional trailers and an empty line
+		if(chunk == 0) {
+			while(1) {
+				while((eol = memmem(r->buf + r->pos, r->len - r->pos, "\r\n", 2)) == NULL)
+					if(reader_fill(r) <= 0) return -1;
+				
+				line_len = eol + 2 - (r->buf + r->pos);
+				if(!dechunk && send_all(client_sock, r->buf + r->pos, line_len) < 0) return -1;
+				r->pos += line_len;
+				if(line_len == 2) return 0;
+			}
+		}
+		
+		//chunk data plus its trailing crlf, which is framing too when dechunking
+		chunk += 2;
+		while(chunk > 0) {
+			if(r->pos == r->len && reader_fill(r) <= 0) return -1;
+			n = r->len - r->pos;
+			if(n > chunk) n = chunk;
+			data = dechunk ? chunk - 2 : chunk;
+			if(data > n) data = n;
+			if(data > 0 && send_all(client_sock, r->buf + r->pos, data) < 0) return -1;
+			r->pos += n;
+			chunk -= n;
+		}
+	}
+}
+
+//forward the request in buffer to upstream u and stream the response back to the client
+//the request goes out as http 1.1 on a pooled connection, and each side gets its own Connection headers
+//an http 1.0 client gets no interim responses, and a chunked response is sent to it unframed and ended by closing
+//returns 0 on success, an http error code if nothing has been sent to the client yet, or -1 if the relay broke mid-response
+//*keep_alive is the number of further requests the client connection may carry, it is cleared if this one ends it
+int proxy_request(int client_sock, struct upstream *u, char *buffer, int buffer_len, int *keep_alive) {
+	struct reader *r;
+	char *out, *head, *head_end, *line, *eol, *line_end, *space, *value;
+	char version[9];
+	long long body_left = 0, content_length = -1;
+	int fd, reused, dropped, attempt, status, head_len, out_len, chunked, reusable, ret, expect_continue, body_refused = 0;
+	int is_head, http10, idempotent, conn_close = 0, conn_keep_alive = 0;
+	
+	head_end = find_head_end(buffer, buffer_len, &head_len);
+	if(head_end == NULL) {
+		upstream_release(u, -1, 0);
+		return 400;
+	}
+	
+	//request line, leading empty lines are ignored as the parser does
+	line = buffer;
+	while(line < head_end && (*line == '\r' || *line == '\n')) line++;
+	if(line == head_end) {
+		upstream_release(u, -1, 0);
+		return 400;
+	}
+	eol = memchr(line, '\n', head_end - line);
+	if(eol == NULL) eol = head_end;
+	line_end = eol;
+	if(line_end > line && line_end[-1] == '\r') line_end--;
+	
+	space = memrchr(line, ' ', line_end - line);
+	if(space == NULL || space == line) {
+		upstream_release(u, -1, 0);
+		return 400;
+	}
+	if(line_end - (space + 1) != 8 || (load64(space + 1) != load64("HTTP/1.0") && load64(space + 1) != load64("HTTP/1.1"))) {
+		upstream_release(u, -1, 0);
+		return 505;
+	}
+	memcpy(version, space + 1, 8);
+	version[8] = 0;
+	http10 = strcmp(version, "HTTP/1.0") == 0;
+	is_head = strncmp(line, "HEAD ", 5) == 0;
+	idempotent = is_head || strncmp(line, "GET ", 4) == 0 || strncmp(line, "PUT ", 4) == 0 || strncmp(line, "DELETE ", 7) == 0
+			|| strncmp(line, "OPTIONS ", 8) == 0 || strncmp(line, "TRACE ", 6) == 0;
+	
+	//request bodies are only relayed by Content-Length, a Transfer-Encoding would frame the body differently
+	//upstream than here and let the rest of it pass for another request on the pooled connection
+	if(find_header(buffer, head_end, "Transfer-Encoding") != NULL) {
+		upstream_release(u, -1, 0);
+		return 501;
+	}
+	
+	//any request body beyond what arrived with the headers is relayed straight from the client socket
+	value = find_header(buffer, head_end, "Content-Length");
+	if(value != NULL) body_left = strtoll(value, NULL, 10) - (buffer_len - head_len);
+	if(body_left < 0) {
+		upstream_release(u, -1, 0);
+		return 400;
+	}
+	value = find_header(buffer, head_end, "Expect");
+	expect_continue = value != NULL && strncasecmp(value, "100-continue", 12) == 0;
 	
-	if(close(client_sock) < 0) error("closing socket");
+	//copy_headers can turn every bare '\n' of a head into "\r\n", so out holds twice the largest head
+	//plus the request line's version and the client's connection headers
+	r = malloc(sizeof(struct reader));
+	out = malloc(2 * sizeof(r->buf) + 256);
 	
+	//the upstream connection is persistent http 1.1 whatever the client speaks
+	out_len = space + 1 - line;
+	memcpy(out, line, out_len);
+	memcpy(out + out_len, "HTTP/1.1\r\n", 10);
+	out_len += 10;
+	out_len += copy_headers(out + out_len, eol < head_end ? eol + 1 : head_end, head_end, NULL, &conn_close, &conn_keep_alive);
+	
+	//Host is required in http 1.1 but optional in 1.0, so a client that left it out gets the upstream's address
+	if(find_header(buffer, head_end, "Host") == NULL)
+		out_len += sprintf(out + out_len, "Host: %s\r\n", u->host);
+	memcpy(out + out_len, "\r\n", 2);
+	out_len += 2;
+	memcpy(out + out_len, buffer + head_len, buffer_len - head_len);
+	out_len += buffer_len - head_len;
+	
+	if(!connection_persists(version, conn_close, conn_keep_alive)) *keep_alive = 0;
+	
+	//a pooled connection may have been closed by the upstream since its last use, which shows as an end of file or reset
+	//before any response, in that case an idempotent request is retried once on a fresh connection as long as no request
+	//body has been consumed yet, anything else such as a timeout may mean the upstream is still acting on the request
+	for(attempt = 0; ; attempt++) {
+		fd = upstream_acquire(u, &reused);
+		if(fd < 0) {
+			ret = 502;
+			goto fail;
+		}
+		
+		r->fd = fd;
+		r->pos = r->len = r->received = 0;
+		status = 0;
+		
+		//recv leaves errno alone at end of file
+		errno = 0;
+		if(send_all(fd, out, out_len) == 0) {
+			//a client that sent Expect: 100-continue holds its body back until the upstream's go-ahead is relayed
+			if(expect_continue && body_left > 0) {
+				status = relay_interim(r, client_sock, !http10, 1, &head_len);
+				if(status == 100) {
+					if(send_all(client_sock, r->buf + r->pos, head_len) < 0) status = -2;
+					r->pos += head_len;
+				}
+			}
+			
+			//a final response in place of the go-ahead refuses the body, which the client may still send
+			if(status == 0 || status == 100) status = splice_relay(client_sock, fd, body_left) < 0 ? -2 : 0;
+			else if(status > 0) body_refused = 1;
+			
+			if(status >= 0) status = relay_interim(r, client_sock, !http10, 0, &head_len);
+			if(status == -2) {
+				ret = -1;
+				goto fail;
+			}
+			if(status > 0) break;
+		}
+		
+		dropped = r->received == 0 && (errno == 0 || errno == ECONNRESET || errno == EPIPE);
+		close(fd);
+		if(!reused || attempt > 0 || body_left > 0 || !idempotent || !dropped) {
+			fd = -1;
+			ret = 502;
+			goto fail;
+		}
+	}
+	
+	//inspect the final response head to find how its body is delimited and whether the connection stays open
+	head = r->buf + r->pos;
+	head_end = head + head_len - 4;
+	
+	value = find_header(head, head_end, "Transfer-Encoding");
+	chunked = value != NULL && strncasecmp(value, "chunked", 7) == 0;
+	value = find_header(head, head_end, "Content-Length");
+	if(value != NULL) content_length = strtoll(value, NULL, 10);
+	
+	//the status line goes to the client as is, the upstream's Connection headers are replaced by the client's own
+	eol = memchr(head, '\n', head_len);
+	out_len = eol + 1 - head;
+	memcpy(out, head, out_len);
+	conn_close = conn_keep_alive = 0;
+	out_len += copy_headers(out + out_len, eol + 1, head_end, chunked && http10 ? "Transfer-Encoding" : NULL, &conn_close, &conn_keep_alive);
+	out[out_len] = 0;
+	
+	//after a refused body the upstream may be waiting for, or discarding, bytes that will never come
+	reusable = strncmp(head, "HTTP/1.1", 8) == 0 && !conn_close && !body_refused;
+	
+	//the client connection can only carry another request if the end of this response is marked, and the body it may
+	//still send after a refusal would be read as one
+	if(body_refused || !(is_head || status == 204 || status == 304 || (chunked && !http10) || content_length >= 0)) *keep_alive = 0;
+	connection_headers(out, version, *keep_alive);
+	
+	if(send_all(client_sock, out, strlen(out)) < 0) {
+		ret = -1;
+		goto fail;
+	}
+	r->pos += head_len;
+	
+	//no body for HEAD requests or 204 and 304 responses
+	if(is_head || status == 204 || status == 304) {
+		ret = 0;
+	}
+	else if(chunked) {
+		ret = relay_chunked(r, client_sock, http10);
+	}
+	else if(content_length >= 0) {
+		//body bytes that arrived with the head go from the reader, the rest is spliced
+		body_left = r->len - r->pos;
+		if(body_left > content_length) body_left = content_length;
+		ret = send_all(client_sock, r->buf + r->pos, body_left);
+		r->pos += body_left;
+		if(ret == 0) ret = splice_relay(fd, client_sock, content_length - body_left);
+	}
+	else {
+		//body runs until the upstream closes, so neither connection can be reused
+		reusable = 0;
+		ret = send_all(client_sock, r->buf + r->pos, r->len - r->pos);
+		if(ret == 0) ret = splice_relay(fd, client_sock, -1);
+	}
+	
+	//anything still in the reader would be taken for the start of the next response
+	if(r->pos != r->len || ret != 0) reusable = 0;
+	if(ret != 0) *keep_alive = 0;
+	
+	upstream_release(u, fd, reusable);
+	free(out);
+	free(r);
+	return ret;
+	
+fail:
+	upstream_release(u, fd, 0);
+	free(out);
+	free(r);
+	return ret;
+}
+
+//fnv-1a, used for the snapshot's path index and etags
+uint64_t fnv1a(char *data, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	
+	for(i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//one file of the document root while a snapshot is being built
+//directory index aliases point at the entry of the index file through alias_of
+struct pack_file {
+	char path[PATH_MAX];
+	char *data, *gzip;
+	long size, gzip_size;
+	char head[PACK_HEAD_SIZE], gzip_head[PACK_HEAD_SIZE];
+	char etag[24], gzip_etag[24];
+	int alias_of;
+	struct pack_entry entry;
+};
+
+struct pack_file *pack_files;
+int n_pack_files = 0;
+
+//add an entry under path that serves the same response as pack_files[target]
+void pack_alias(char *path, int target) {
+	struct pack_file *f;
+	
+	if(n_pack_files == MAX_PACK_ENTRIES) error("too many files to pack");
+	f = &pack_files[n_pack_files++];
+	memset(f, 0, sizeof(*f));
+	strcpy(f->path, path);
+	f->alias_of = target;
+}
+
+//nftw callback, reads one file of www and prepares its response headers and gzip variant
+int pack_add_file(const char *fpath, const struct stat *sb, int type, struct FTW *ftwbuf) {
+	struct pack_file *f;
+	char content_type[32], *ext, *dot;
+	FILE *fp;
+	int compressible;
+	z_stream zs;
+	struct preload_hints *hints;
+	
+	if(type != FTW_F) return 0;
+	if(n_pack_files == MAX_PACK_ENTRIES) error("too many files to pack");
+	
+	f = &pack_files[n_pack_files];
+	memset(f, 0, sizeof(*f));
+	f->alias_of = -1;
+	
+	//uri paths are relative to www, so "./www/css/style.css" is stored as "/css/style.css"
+	if(strlen(fpath + 5) >= sizeof(f->path)) error("path too long to pack");
+	strcpy(f->path, fpath + 5);
+	
+	fp = fopen(fpath, "r");
+	if(fp == NULL) {
+		printf("skipping %s: %s\n", fpath, strerror(errno));
+		return 0;
+	}
+	f->size = get_content_length(fp);
+	f->data = malloc(f->size + 1);
+	if(fread(f->data, 1, f->size, fp) != (size_t)f->size) error("reading file");
+	f->data[f->size] = 0;
+	fclose(fp);
+	n_pack_files++;
+	
+	dot = strrchr(f->path, '.');
+	ext = (dot == NULL || strchr(dot, '/') != NULL) ? NULL : dot + 1;
+	get_content_type(content_type, ext);
+	compressible = strncmp(content_type, "text/", 5) == 0 || strcmp(content_type, "application/javascript") == 0;
+	
+	//each encoding is a different representation, so the gzip variant gets its own strong etag
+	sprintf(f->etag, "\"%016llx\"", (unsigned long long)fnv1a(f->data, f->size));
+	sprintf(f->gzip_etag, "\"%016llx-gz\"", (unsigned long long)fnv1a(f->data, f->size));
+	
+	//keep a gzip variant when it saves at least a tenth of the transfer
+	if(compressible && f->size > 0) {
+		memset(&zs, 0, sizeof(zs));
+		if(deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) error("initializing gzip");
+		
+		f->gzip = malloc(deflateBound(&zs, f->size));
+		zs.next_in = (Bytef *)f->data;
+		zs.avail_in = f->size;
+		zs.next_out = (Bytef *)f->gzip;
+		zs.avail_out = deflateBound(&zs, f->size);
+		if(deflate(&zs, Z_FINISH) != Z_STREAM_END) error("compressing file");
+		f->gzip_size = zs.total_out;
+		deflateEnd(&zs);
+		
+		if(f->gzip_size > f->size * 9 / 10) {
+			free(f->gzip);
+			f->gzip = NULL;
+			f->gzip_size = 0;
+		}
+	}
+	
+	//serialized headers, the status line and connection headers are added per request
+	snprintf(f->head, PACK_HEAD_SIZE, "Content-Type: %s\r\nContent-Length: %ld\r\nETag: %s\r\n%s",
+			content_type, f->size, f->etag, compressible ? "Vary: Accept-Encoding\r\n" : "");
+	if(f->gzip != NULL)
+		snprintf(f->gzip_head, PACK_HEAD_SIZE, "Content-Type: %s\r\nContent-Length: %ld\r\nETag: %s\r\n"
+				"Vary: Accept-Encoding\r\nContent-Encoding: gzip\r\n", content_type, f->gzip_size, f->gzip_etag);
+	
+	//pages also carry the preload hints for their assets, which are already in the snapshot so need no read ahead
+	if(strcmp(content_type, "text/html")==0) {
+		hints = calloc(1, sizeof(struct preload_hints));
+		scan_preload_hints(f->data, f->size, f->path, hints);
+		if(hints->link[0] != 0) {
+			sprintf(f->head + strlen(f->head), "Link: %s\r\n", hints->link);
+			if(f->gzip != NULL) sprintf(f->gzip_head + strlen(f->gzip_head), "Link: %s\r\n", hints->link);
+		}
+		free(hints);
+	}
+	
+	return 0;
+}
+
+//pack ./www into a single snapshot file for -S
+void build_pack(char *out_path) {
+	struct pack_header header;
+	uint32_t *buckets, slot;
+	uint64_t offset;
+	char index_path[PATH_MAX];
+	int i, j, n_files;
+	size_t len;
+	FILE *out;
+	
+	pack_files = malloc(sizeof(struct pack_file) * MAX_PACK_ENTRIES);
+	if(nftw("./www", pack_add_file, 16, FTW_PHYS) != 0) error("walking www");
+	
+	//directory requests are served index.htm, or failing that index.html
+	n_files = n_pack_files;
+	for(i = 0; i < n_files; i++) {
+		len = strlen(pack_files[i].path);
+		if(len >= 10 && strcmp(pack_files[i].path + len - 10, "/index.htm") == 0) {
+			strcpy(index_path, pack_files[i].path);
+			index_path[len - 9] = 0;
+			pack_alias(index_path, i);
+		}
+	}
+	for(i = 0; i < n_files; i++) {
+		len = strlen(pack_files[i].path);
+		if(len >= 11 && strcmp(pack_files[i].path + len - 11, "/index.html") == 0) {
+			strcpy(index_path, pack_files[i].path);
+			index_path[len - 10] = 0;
+			for(j = n_files; j < n_pack_files; j++)
+				if(strcmp(pack_files[j].path, index_path) == 0) break;
+			if(j == n_pack_files) pack_alias(index_path, i);
+		}
+	}
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, 8);
+	header.n_entries = n_pack_files;
+	header.n_buckets = 16;
+	while(header.n_buckets < header.n_entries * 2) header.n_buckets *= 2;
+	buckets = calloc(header.n_buckets, sizeof(uint32_t));
+	
+	//lay out the data region after the index, aliases share their target's header and body bytes
+	offset = sizeof(header) + header.n_buckets * sizeof(uint32_t) + n_pack_files * sizeof(struct pack_entry);
+	for(i = 0; i < n_pack_files; i++) {
+		struct pack_file *f = &pack_files[i];
+		struct pack_entry *e = &f->entry;
+		
+		e->path_len = strlen(f->path);
+		e->path_off = offset;
+		offset += e->path_len;
+		e->hash = (uint32_t)fnv1a(f->path, e->path_len);
+		
+		if(f->alias_of >= 0) {
+			struct pack_entry *target = &pack_files[f->alias_of].entry;
+			e->head_off = target->head_off;
+			e->head_len = target->head_len;
+			e->body_off = target->body_off;
+			e->body_len = target->body_len;
+			e->gzip_head_off = target->gzip_head_off;
+			e->gzip_head_len = target->gzip_head_len;
+			e->gzip_off = target->gzip_off;
+			e->gzip_len = target->gzip_len;
+			strcpy(e->etag, target->etag);
+		}
+		else {
+			e->head_len = strlen(f->head);
+			e->head_off = offset;
+			offset += e->head_len;
+			e->gzip_head_len = strlen(f->gzip_head);
+			e->gzip_head_off = offset;
+			offset += e->gzip_head_len;
+			e->body_len = f->size;
+			e->body_off = offset;
+			offset += f->size;
+			e->gzip_len = f->gzip_size;
+			e->gzip_off = offset;
+			offset += f->gzip_size;
+			strcpy(e->etag, f->etag);
+		}
+		
+		slot = e->hash & (header.n_buckets - 1);
+		while(buckets[slot] != 0) slot = (slot + 1) & (header.n_buckets - 1);
+		buckets[slot] = i + 1;
+	}
+	
+	out = fopen(out_path, "w");
+	if(out == NULL) error("opening snapshot for writing");
+	
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(buckets, sizeof(uint32_t), header.n_buckets, out);
+	for(i = 0; i < n_pack_files; i++) fwrite(&pack_files[i].entry, sizeof(struct pack_entry), 1, out);
+	for(i = 0; i < n_pack_files; i++) {
+		struct pack_file *f = &pack_files[i];
+		
+		fwrite(f->path, 1, f->entry.path_len, out);
+		if(f->alias_of >= 0) continue;
+		fwrite(f->head, 1, f->entry.head_len, out);
+		fwrite(f->gzip_head, 1, f->entry.gzip_head_len, out);
+		fwrite(f->data, 1, f->size, out);
+		fwrite(f->gzip, 1, f->gzip_size, out);
+	}
+	if(ferror(out) || fclose(out) != 0) error("writing snapshot");
+	
+	printf("packed %d entries, %llu bytes, into %s\n", n_pack_files, (unsigned long long)offset, out_path);
+}
+
+//map a snapshot built with -B, prefaulting it so the first requests don't wait on the disk
+void load_pack(char *path) {
+	struct pack_header *header;
+	struct stat st;
+	int fd;
+	
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) error("opening snapshot");
+	if(st.st_size < (off_t)sizeof(struct pack_header)) error("snapshot is truncated");
+	
+	pack = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if(pack == MAP_FAILED) error("mapping snapshot");
+	close(fd);
+	
+	header = (struct pack_header *)pack;
+	if(memcmp(header->magic, PACK_MAGIC, 8) != 0) error("not a snapshot file");
+	if(sizeof(struct pack_header) + (uint64_t)header->n_buckets * sizeof(uint32_t)
+			+ (uint64_t)header->n_entries * sizeof(struct pack_entry) > (uint64_t)st.st_size)
+		error("snapshot is truncated");
+	
+	pack_buckets = (uint32_t *)(pack + sizeof(struct pack_header));
+	pack_entries = (struct pack_entry *)(pack_buckets + header->n_buckets);
+}
+
+//look up a uri in the snapshot's hash index, returns NULL if it wasn't packed
+struct pack_entry *pack_lookup(char *uri) {
+	struct pack_header *header = (struct pack_header *)pack;
+	struct pack_entry *e;
+	size_t len = strlen(uri);
+	uint32_t hash = (uint32_t)fnv1a(uri, len);
+	uint32_t slot = hash & (header->n_buckets - 1);
+	
+	while(pack_buckets[slot] != 0) {
+		e = &pack_entries[pack_buckets[slot] - 1];
+		if(e->hash == hash && e->path_len == len && memcmp(pack + e->path_off, uri, len) == 0)
+			return e;
+		slot = (slot + 1) & (header->n_buckets - 1);
+	}
+	return NULL;
+}
+
+//send the snapshot's response for uri, returns an error code if it isn't in the snapshot, or -1 if the connection should be closed
+int serve_from_pack(int client_sock, char *uri, char *version, int keep_alive, char *if_none_match, int accept_gzip) {
+	struct pack_entry *e;
+	struct out_queue q;
+	char status[64], tag[32], etag[64], connection[128];
+	int not_modified, gzip;
+	
+	e = pack_lookup(uri);
+	timing_mark(PHASE_OPEN);
+	if(e == NULL) return 404;
+	
+	//the gzip variant's etag is the identity one with "-gz" before the closing quote
+	gzip = accept_gzip && e->gzip_len > 0;
+	if(gzip) sprintf(tag, "%.17s-gz\"", e->etag);
+	else strcpy(tag, e->etag);
+	not_modified = if_none_match != NULL && strstr(if_none_match, tag) != NULL;
+	
+	q.sock = client_sock;
+	q.n = 0;
+	queue_data(&q, status, sprintf(status, "%s %s\r\n", version, not_modified ? "304 Not Modified" : "200 OK"));
+	
+	if(not_modified) queue_data(&q, etag, sprintf(etag, "ETag: %s\r\n", tag));
+	else queue_data(&q, pack + (gzip ? e->gzip_head_off : e->head_off), gzip ? e->gzip_head_len : e->head_len);
+	
+	connection[0] = 0;
+	connection_headers(connection, version, keep_alive);
+	queue_data(&q, connection, strlen(connection));
+	
+	if(!not_modified) queue_data(&q, pack + (gzip ? e->gzip_off : e->body_off), gzip ? e->gzip_len : e->body_len);
+	
+	if(flush_queue(&q) < 0) return -1;
+	timing_mark(PHASE_WRITE);
+	responses++;
+	return 0;
+}
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//milliseconds left until a monotonic_ns deadline, rounded up, or 0 once it has passed
+int ms_until(uint64_t deadline) {
+	uint64_t now = monotonic_ns();
+	
+	return now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+}
+
+//charge the time since the last mark to phase, if this thread's request is being timed
+void timing_mark(int phase) {
+	uint64_t now;
+	
+	if(!timing.sampled) return;
+	now = monotonic_ns();
+	timing.phase[phase] += now - timing.mark;
+	timing.mark = now;
+}
+
+//fold a finished request into the phase histograms, and log its breakdown if it was slow
+void timing_end(char *uri) {
+	int i, bucket;
+	
+	if(!timing.sampled) return;
+	timing.sampled = 0;
+	timing.phase[PHASE_TOTAL] = timing.mark - timing.start;
+	
+	for(i = 0; i < N_PHASES; i++) {
+		//phases a request never went through aren't counted, so each histogram describes the requests that did
+		if(timing.phase[i] == 0 && i != PHASE_TOTAL) continue;
+		bucket = timing.phase[i] == 0 ? 0 : 64 - __builtin_clzll(timing.phase[i]);
+		if(bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+		__atomic_fetch_add(&phase_hist[i][bucket], 1, __ATOMIC_RELAXED);
+	}
+	
+	if(slow_threshold > 0 && timing.phase[PHASE_TOTAL] >= slow_threshold) {
+		char line[512];
+		int len;
+		
+		len = snprintf(line, sizeof(line), "slow request %.3fms %s:", timing.phase[PHASE_TOTAL] / 1e6, uri == NULL ? "-" : uri);
+		for(i = 0; i < PHASE_TOTAL && len < (int)sizeof(line) - 1; i++)
+			if(timing.phase[i] != 0)
+				len += snprintf(line + len, sizeof(line) - 1 - len, " %s %.3fms", phase_names[i], timing.phase[i] / 1e6);
+		if(len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+		line[len++] = '\n';
+		
+		//written straight to the fd in one piece, stdout is block buffered when redirected to a file and would
+		//hold the line back until kilobytes more output or a SIGUSR1, or lose it if the server is killed
+		if(write(STDOUT_FILENO, line, len) < 0) return;
+	}
+}
+
+//print each phase's request count and approximate percentiles whenever SIGUSR1 arrives
+//percentiles are the upper bound of the bucket they fall in, so they overestimate by at most 2x
+void *report_timing(void *unused) {
+	uint64_t counts[HIST_BUCKETS], total, seen;
+	double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	sigset_t usr1;
+	int sig, i, b, p;
+	
+	pthread_detach(pthread_self());
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	
+	while(sigwait(&usr1, &sig) == 0) {
+		printf("phase       count       p50       p90       p99     p99.9  (us)\n");
+		
+		for(i = 0; i < N_PHASES; i++) {
+			total = 0;
+			for(b = 0; b < HIST_BUCKETS; b++) {
+				counts[b] = __atomic_load_n(&phase_hist[i][b], __ATOMIC_RELAXED);
+				total += counts[b];
+			}
+			if(total == 0) continue;
+			
+			printf("%-8s %8llu", phase_names[i], (unsigned long long)total);
+			for(p = 0; p < 4; p++) {
+				seen = 0;
+				for(b = 0; b < HIST_BUCKETS - 1; b++) {
+					seen += counts[b];
+					if(seen >= total * percentiles[p]) break;
+				}
+				printf(" %9.1f", (double)(1ULL << b) / 1000);
+			}
+			printf("\n");
+		}
+		fflush(stdout);
+	}
+	
+	return NULL;
+}
+
+//find the same-origin scripts, stylesheets and images an html page loads, and build its Link header
+//only src attributes and the href of <link> tags count, anchors are navigations the browser may never follow
+//uri is the page's uri, which relative references are resolved against
+void scan_preload_hints(char *html, long size, char *uri, struct preload_hints *h) {
+	char *p, *end = html + size, *value, *value_end, *tag, *slash, *ext, *as;
+	char path[256], file[256 + 8];
+	int i, dir_len, base_len, value_len, is_src;
+	struct stat st;
+	
+	h->link[0] = 0;
+	h->n_assets = 0;
+	
+	slash = strrchr(uri, '/');
+	dir_len = slash == NULL ? 0 : slash + 1 - uri;
+	
+	for(p = html; p < end - 5 && h->n_assets < MAX_HINTS; p++) {
+		is_src = strncasecmp(p, "src=", 4) == 0;
+		if(!is_src && strncasecmp(p, "href=", 5) != 0) continue;
+		if(p > html && (isalnum((unsigned char)p[-1]) || p[-1] == '-')) continue;
+		
+		//find the tag the attribute belongs to
+		for(tag = p; tag > html && *tag != '<' && *tag != '>'; tag--);
+		if(*tag != '<' || (!is_src && strncasecmp(tag, "<link", 5) != 0)) continue;
+		
+		value = p + (is_src ? 4 : 5);
+		if(*value == '"' || *value == '\'') {
+			value_end = memchr(value + 1, *value, end - value - 1);
+			value++;
+		}
+		else {
+			for(value_end = value; value_end < end && !isspace((unsigned char)*value_end) && *value_end != '>'; value_end++);
+		}
+		if(value_end == NULL) break;
+		p = value_end;
+		
+		//only local files, and never anything that could step outside www
+		//the value is measured within value_end, html needn't be nul terminated
+		for(value_len = 0; value + value_len < value_end && strchr("?#\"'> \t\r\n", value[value_len]) == NULL; value_len++);
+		if(value_len == 0 || memmem(value, value_len, ":", 1) != NULL || memmem(value, value_len, "..", 2) != NULL
+				|| (value_len > 1 && value[0] == '/' && value[1] == '/'))
+			continue;
+		if(value_len > 2 && value[0] == '.' && value[1] == '/') {
+			value += 2;
+			value_len -= 2;
+		}
+		base_len = value[0] == '/' ? 0 : dir_len;
+		if(base_len + value_len >= (int)sizeof(path)) continue;
+		
+		memcpy(path, uri, base_len);
+		memcpy(path + base_len, value, value_len);
+		path[base_len + value_len] = 0;
+		
+		ext = strrchr(path, '.');
+		if(ext == NULL) continue;
+		ext++;
+		if(strcmp(ext, "js")==0) as = "script";
+		else if(strcmp(ext, "css")==0) as = "style";
+		else if(strcmp(ext, "png")==0 || strcmp(ext, "gif")==0 || strcmp(ext, "jpg")==0) as = "image";
+		else continue;
+		
+		sprintf(file, "./www%s", path);
+		if(stat(file, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+		
+		for(i = 0; i < h->n_assets; i++)
+			if(strcmp(h->assets[i], file) == 0) break;
+		if(i < h->n_assets) continue;
+		if(strlen(h->link) + strlen(path) + 40 >= sizeof(h->link)) break;
+		
+		strcpy(h->assets[h->n_assets++], file);
+		sprintf(h->link + strlen(h->link), "%s<%s>; rel=preload; as=%s", h->link[0] == 0 ? "" : ", ", path, as);
+	}
+}
+
+//copy the preload hints for the html page open as fp into *out, scanning the page if it changed since it was last seen
+//returns 1 if the page references any assets
+int get_preload_hints(char *path, char *uri, FILE *fp, struct preload_hints *out) {
+	struct stat st;
+	char *html;
+	int i, cached = 0;
+	
+	if(fstat(fileno(fp), &st) < 0 || strlen(path) >= sizeof(out->path)) return 0;
+	
+	pthread_mutex_lock(&hint_lock);
+	for(i = 0; i < MAX_HINT_PAGES; i++) {
+		if(strcmp(hint_cache[i].path, path) == 0 && hint_cache[i].mtime == st.st_mtime && hint_cache[i].size == st.st_size) {
+			memcpy(out, &hint_cache[i], sizeof(*out));
+			cached = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hint_lock);
+	if(cached) return out->link[0] != 0;
+	
+	//the page is read and scanned without the lock held, so a cold read only delays this request and not every html one
+	html = malloc(st.st_size + 1);
+	if(pread(fileno(fp), html, st.st_size, 0) != st.st_size) {
+		free(html);
+		return 0;
+	}
+	html[st.st_size] = 0;
+	scan_preload_hints(html, st.st_size, uri, out);
+	free(html);
+	strcpy(out->path, path);
+	out->mtime = st.st_mtime;
+	out->size = st.st_size;
+	
+	//install the result over the page's old entry, or in the next slot if it has none
+	pthread_mutex_lock(&hint_lock);
+	for(i = 0; i < MAX_HINT_PAGES; i++)
+		if(strcmp(hint_cache[i].path, path) == 0) break;
+	if(i == MAX_HINT_PAGES) {
+		i = next_hint_slot;
+		next_hint_slot = (next_hint_slot + 1) % MAX_HINT_PAGES;
+	}
+	memcpy(&hint_cache[i], out, sizeof(*out));
+	pthread_mutex_unlock(&hint_lock);
+	
+	return out->link[0] != 0;
+}
+
+//ask the kernel to start reading a page's assets into the page cache, without waiting for it
+void warm_assets(struct preload_hints *h) {
+	int i, fd;
+	
+	for(i = 0; i < h->n_assets; i++) {
+		fd = open(h->assets[i], O_RDONLY);
+		if(fd < 0) continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+//start capturing a request trace to path, for replay with replay.c
+void open_trace(char *path) {
+	trace_file = fopen(path, "w");
+	if(trace_file == NULL) error("opening trace file");
+	
+	//large buffer so a capture costs a memcpy per request, not a write
+	setvbuf(trace_file, NULL, _IOFBF, 1 << 20);
+	fwrite(TRACE_MAGIC, 1, 8, trace_file);
+	trace_start = monotonic_ns();
+}
+
+//append one event to the trace, data is the raw request for TRACE_REQUEST
+void trace_event(uint32_t conn, int type, char *data, int len) {
+	struct trace_record record;
+	
+	record.conn = conn;
+	record.type = type;
+	record.len = len;
+	
+	pthread_mutex_lock(&trace_lock);
+	record.time = monotonic_ns() - trace_start;
+	fwrite(&record, sizeof(record), 1, trace_file);
+	if(len > 0) fwrite(data, 1, len, trace_file);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+//the server is normally stopped with a signal, so the buffered tail of the trace is flushed every second,
+//whether or not more events arrive, and at most the last second is lost
+void *flush_trace(void *unused) {
+	pthread_detach(pthread_self());
+	
+	while(1) {
+		sleep(1);
+		pthread_mutex_lock(&trace_lock);
+		fflush(trace_file);
+		pthread_mutex_unlock(&trace_lock);
+	}
 	return NULL;
 }